@@ -1,15 +1,40 @@
 #include <ctype.h>
+#include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// Bump allocator freed in bulk
+typedef struct Arena Arena;
+struct Arena {
+    char *name; // Arena name
+    void *chunks; // Allocated chunks
+    char *ptr; // Next free byte
+    char *end; // End of current chunk
+    long bytes; // Bytes allocated since last free
+    long freed; // Bytes released by arena_free
+    long objects; // Number of allocations
+    long reserved; // Bytes reserved from system
+};
+
 // Local variable type
 typedef struct Var Var;
 struct Var {
     char *name; // Variable name
     int offset; // Offset from RBP
+
+    // Loop optimization
+    int loop; // Last loop found to assign variable
+    bool not_iv; // Assigned in that loop other than by adding constant
+    int step_min; // Range of added constants
+    int step_max;
+
+    // Frame layout
+    int index; // Number in var_list while sharing slots
+    int vreg; // Virtual register holding variable (0 if in memory)
 };
 
 typedef struct VarList VarList;
@@ -26,13 +51,41 @@ typedef enum {
     TK_EOF // EOF
 } TokenPattern;
 
+// Punctuator and keyword
+typedef enum {
+    PN_ADD, // +
+    PN_SUB, // -
+    PN_MUL, // *
+    PN_DIV, // /
+    PN_LPAREN, // (
+    PN_RPAREN, // )
+    PN_LT, // <
+    PN_GT, // >
+    PN_SEMICOLON, // ;
+    PN_ASSIGN, // =
+    PN_LBRACE, // {
+    PN_RBRACE, // }
+    PN_COMMA, // ,
+    PN_AMP, // &
+    PN_EQ, // ==
+    PN_NE, // !=
+    PN_LE, // <=
+    PN_GE, // >=
+    PN_IF, // if
+    PN_ELSE, // else
+    PN_WHILE, // while
+    PN_FOR, // for
+    PN_RETURN, // return
+    PN_NONE, // Not a punctuator
+} Punct;
+
 typedef struct Token Token;
 struct Token {
-    TokenPattern pattern; // Token pattern
-    Token *next; // Next token
-    int val; // Value of number
-    char *str; // Token string
+    unsigned char pattern; // Token pattern
+    unsigned char punct; // Punctuator (used if TK_RESERVED)
+    int offset; // Offset in user_input
     int len; // Token length
+    int val; // Value of number or interned ID of identifier
 };
 
 // Node pattern
@@ -41,6 +94,7 @@ typedef enum {
     ND_SUB, // -
     ND_MUL, // *
     ND_DIV, // /
+    ND_NEG, // Unary -
     ND_EQ, // ==
     ND_NE, // !=
     ND_LT, // <
@@ -56,6 +110,7 @@ typedef enum {
     ND_RETURN, // return
     ND_BLOCK, // Block { ... }
     ND_FUNCALL, // Call function
+    ND_INLINE, // Body of inlined function
 } NodePattern;
 
 typedef struct Node Node;
@@ -84,6 +139,26 @@ struct Node {
     // Function
     char *fn_name; // Function name
     Node *args; // Function args
+
+    // Profile
+    long *count; // Counts of then/body and else/exit edges, or entries of inlined function (NULL if none)
+};
+
+// Variables of function keyed by identifier ID
+typedef struct Scope Scope;
+struct Scope {
+    int cap; // Number of slots
+    int used; // Number of used slots
+    int *keys; // Identifier IDs
+    Var **vars; // Variables (NULL if empty)
+};
+
+// Growable output buffer
+typedef struct Buffer Buffer;
+struct Buffer {
+    char *data; // Bytes
+    int len; // Used length
+    int cap; // Capacity
 };
 
 typedef struct Function Function;
@@ -93,23 +168,379 @@ struct Function {
     VarList *params; // Function params
     VarList *var_list; // Varible list
     Node *node; // Node in function
+    int stack_size; // Size of local variables area
+    bool leaf; // Makes no calls, so frame is addressed from RSP
+    long *count; // Profile counters, entries first (NULL if none)
+    unsigned long cache_key; // Key of cache entry (0 if not cached)
+    Buffer cached; // Output taken from cache (empty on miss)
+};
+
+// IR pattern
+typedef enum {
+    IR_IMM, // dst = imm
+    IR_LVAR, // dst = &var
+    IR_ADD, // dst = a + b
+    IR_SUB, // dst = a - b
+    IR_MUL, // dst = a * b
+    IR_DIV, // dst = a / b
+    IR_EQ, // dst = a == b
+    IR_NE, // dst = a != b
+    IR_LT, // dst = a < b
+    IR_LE, // dst = a <= b
+    IR_NEG, // dst = -a
+    IR_COPY, // dst = a
+    IR_LOAD, // dst = *a
+    IR_STORE, // *a = b
+    IR_CALL, // dst = sym(args...)
+    IR_JMP, // goto then
+    IR_BR, // if (a) goto then; else goto els
+    IR_RET, // return a
+    IR_TAILCALL, // return sym(args...) reusing frame
+    IR_COUNT, // Increment profile counter at byte imm of counters
+} IRPattern;
+
+typedef struct BasicBlock BasicBlock;
+
+// IR instruction. Every value is defined exactly once (SSA); local
+// variables stay in memory and are accessed through IR_LOAD/IR_STORE.
+typedef struct IR IR;
+struct IR {
+    IRPattern pattern; // IR pattern
+    IR *next; // Next instruction in block
+    int dst; // Defined value (0 if none)
+    int a; // First operand value
+    int b; // Second operand value
+    long imm; // Immediate (used if IR_IMM or IR_COUNT)
+    Var *var; // Variable (used if IR_LVAR)
+    char *sym; // Callee (used if IR_CALL or IR_TAILCALL)
+    int *args; // Argument values (used if IR_CALL or IR_TAILCALL)
+    int nargs; // Number of arguments (used if IR_CALL or IR_TAILCALL)
+    BasicBlock *then; // Jump target (used if IR_JMP or IR_BR)
+    BasicBlock *els; // Target if a is zero (used if IR_BR)
+};
+
+struct BasicBlock {
+    BasicBlock *next; // Next block in layout order
+    int id; // Block number
+    IR *ir; // First instruction
+    IR *last; // Last instruction (terminator)
+    int label; // Assembly label
+    int rpo; // Reverse postorder number (-1 if unreachable)
+    BasicBlock *idom; // Immediate dominator
+    bool cold; // Never reached in profile, so laid out after hot blocks
+};
+
+typedef struct IRFunc IRFunc;
+struct IRFunc {
+    Function *fn; // Lowered function
+    BasicBlock *blocks; // Blocks in layout order (entry first)
+    int nvalue; // Number of values
+    int nblock; // Number of blocks
+};
+
+// Compiler phase measured by -ftime-report
+typedef enum {
+    PH_TOKENIZE, // tokenizer()
+    PH_PARSE, // program()
+    PH_FOLD, // fold_program()
+    PH_INLINE, // inline_functions()
+    PH_LOOP, // optimize_loops()
+    PH_BUILD, // build()
+    PH_LOWER, // AST to IR (inside build)
+    PH_IR_OPT, // IR passes (inside build)
+    PH_ISEL, // Instruction selection (inside build)
+    PH_REGALLOC, // Register allocation and frame (inside build)
+    PH_PEEPHOLE, // Peephole optimization (inside build)
+    PH_EMIT, // Assembly printing or encoding (inside build)
+} Phase;
+
+// Physical register (in x86-64 encoding order)
+typedef enum {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+} Reg;
+
+// Condition code
+typedef enum {
+    CC_E, // ==
+    CC_NE, // !=
+    CC_L, // <
+    CC_LE, // <=
+    CC_G, // >
+    CC_GE, // >=
+} CondCode;
+
+// Operand pattern
+typedef enum {
+    OP_NONE, // No operand
+    OP_REG, // Physical register
+    OP_VREG, // Virtual register
+    OP_IMM, // Immediate
+    OP_MEM, // Memory addressed by physical register
+    OP_VMEM, // Memory addressed by virtual register
+    OP_SYM, // Memory at symbol addressed from RIP
+} OperandPattern;
+
+typedef struct Operand Operand;
+struct Operand {
+    OperandPattern pattern; // Operand pattern
+    int reg; // Register number (base register if memory)
+    long val; // Immediate value or displacement
+    char *sym; // Symbol (used if OP_SYM)
+};
+
+// Instruction pattern
+typedef enum {
+    IN_MOV, // mov dst, src
+    IN_LEA, // lea dst, src
+    IN_ADD, // add dst, src
+    IN_SUB, // sub dst, src
+    IN_IMUL, // imul dst, src
+    IN_CQO, // cqo
+    IN_IDIV, // idiv src
+    IN_IMULH, // imul src (rdx:rax = rax * src)
+    IN_SHL, // shl dst, imm
+    IN_SAR, // sar dst, imm
+    IN_SHR, // shr dst, imm
+    IN_NEG, // neg dst
+    IN_CMP, // cmp dst, src
+    IN_SETCC, // setcc dst (low byte)
+    IN_MOVZB, // movzb dst, dst (low byte)
+    IN_PUSH, // push src
+    IN_POP, // pop dst
+    IN_JMP, // jmp label
+    IN_JCC, // jcc label
+    IN_CALL, // call sym
+    IN_TAILCALL, // jmp sym (frame is left before)
+    IN_LABEL, // label:
+    IN_RET, // ret
+    IN_GLOBAL, // .global sym
+    IN_SYMBOL, // sym:
+} InstPattern;
+
+typedef struct Inst Inst;
+struct Inst {
+    InstPattern pattern; // Instruction pattern
+    Inst *next; // Next instruction
+    Operand dst; // Destination operand
+    Operand src; // Source operand
+    CondCode cc; // Condition (used if IN_SETCC or IN_JCC)
+    int label; // Label number (used if IN_LABEL, IN_JMP or IN_JCC)
+    char *sym; // Symbol name (used if IN_CALL, IN_TAILCALL, IN_GLOBAL or IN_SYMBOL)
+};
+
+// Result of register allocation
+typedef struct RegAlloc RegAlloc;
+struct RegAlloc {
+    Inst *insts; // Rewritten instructions
+    int stack_size; // Frame size including spill and save slots (multiple of 16)
+    int save_offset[16]; // Save slot of callee-saved register (0 if unused)
+};
+
+// Section of object holding symbol
+typedef enum {
+    SC_TEXT, // Code
+    SC_RODATA, // Read-only data
+    SC_BSS, // Zero-initialized data
+} Section;
+
+// Symbol of object file (names starting with ".L" are local)
+typedef struct ObjSym ObjSym;
+struct ObjSym {
+    char *name; // Symbol name
+    int offset; // Offset in its section (used if defined)
+    int size; // Size of function or data
+    bool defined; // Defined in this object
+    Section section; // Section of definition
+};
+
+// Relocation of rel32 field in text to symbol
+typedef struct ObjReloc ObjReloc;
+struct ObjReloc {
+    int offset; // Offset of rel32 field in text
+    int sym; // Index of symbol
+    long addend; // Added to symbol address before subtracting field address
+    bool data; // RIP-relative data address (call or jump target otherwise)
 };
 
+// Machine code of translation unit
+typedef struct Object Object;
+struct Object {
+    Buffer text; // Code bytes
+    ObjSym *syms; // Symbols
+    int nsym; // Number of symbols
+    ObjReloc *relocs; // Relocations against undefined or data symbols
+    int nreloc; // Number of relocations
+    Buffer rodata; // Read-only data bytes
+    long bss_size; // Size of zero-initialized data
+    char *init_fn; // Function listed in .init_array (NULL if none)
+};
+
+// Counters of function in profile
+typedef struct ProfFunc ProfFunc;
+struct ProfFunc {
+    char *name; // Function name
+    long *counts; // Entry, then taken and not taken edges of branches
+    int n; // Number of counters
+    int offset; // Index of first counter in .bss of instrumented program
+};
+
+unsigned hash_string(char *s, int len);
+int intern(char *s, int len);
+char *intern_name(int id);
+void intern_reset();
+Scope *new_scope();
+Var *scope_find(Scope *scope, int id);
+void scope_add(Scope *scope, int id, Var *var);
+
+void *arena_alloc(Arena *arena, long size);
+char *arena_strndup(Arena *arena, char *s, int len);
+void arena_free(Arena *arena);
+void arena_report(Arena *arena);
+void arena_merge(Arena *dst, Arena *src);
 
 void error(char *fmt, ...);
+void error_exit();
 void error_at(char *loc, char *fmt, ...);
-bool read_next_token(char *op);
+bool read_next_token(Punct op);
 Token *read_next_ident();
-void expect(char *op);
-char *get_ident();
+void expect(Punct op);
+char *token_loc(Token *token);
+int get_ident();
 int get_number();
 bool at_eof();
 
+Node *new_node(NodePattern pattern);
+Node *new_binary(NodePattern pattern, Node *lhs, Node *rhs);
+Node *new_val_node(int val);
 Function *program();
+Function *function();
+void fold_program(Function *program);
+bool eval_binary(NodePattern pattern, long lhs, long rhs, long *val);
+void inline_functions(Function *program);
+void optimize_loops(Function *program);
+bool has_addr(Node *node);
+void attach_profile(Function *program);
+long edge_count(Node *node, int edge);
+long entry_count(Function *fn);
+long counter_offset(long *count);
+void read_profile(char *path);
+void write_profile();
 
-Token *tokenizer();
-void build(Function *program);
+void tokenizer();
+void read_source(char *path);
+void set_source(char *str);
+bool is_space_char(char c);
+bool is_digit_char(char c);
+void init_scanner(bool simd);
+extern char *(*scan_space)(char *p, char *end);
+extern char *(*scan_digit)(char *p, char *end);
+extern char *(*scan_ident)(char *p, char *end);
+IRFunc *lower_function(Function *fn);
+void dump_ir(IRFunc *fn, char *title);
+int ir_succs(BasicBlock *bb, BasicBlock **succ);
+int ir_operands(IR *ir, int **opd);
+void run_ir_passes(IRFunc *fn);
+IR **value_defs(IRFunc *fn);
+void share_slots(Function *fn, IRFunc *ir);
+bool address_escapes(IRFunc *fn, IR **def);
+bool is_leaf(IRFunc *fn);
+int build(Function *program, Buffer *out);
+void allocate_memory(Function *fn);
+Inst *new_inst(InstPattern pattern, Operand dst, Operand src);
+RegAlloc regalloc(Inst *insts, int nvreg, int stack_size, bool leaf);
+Operand reg_operand(int reg);
+bool bit_test(unsigned long *set, int i);
+void bit_set(unsigned long *set, int i);
+void inst_vregs(Inst *in, int *use, int *nuse, int *def, int *ndef);
+bool is_terminator(Inst *in);
+Inst *peephole_vreg(Inst *insts, int nvreg);
+Inst *peephole(Inst *insts);
+int max_label(Inst *insts);
+bool is_imm32(long val);
+void encode_function(Inst *insts, Object *obj);
+void link_objects(Object *parts, int nparts, Object *obj);
+void define_symbol(Object *obj, char *name, Section section, int offset, int size);
+void write_elf(Object *obj, Buffer *buf);
+void phase_begin(Phase ph);
+void phase_end(Phase ph);
+long phase_clock();
+long phase_lap(Phase ph, long start);
+void time_report();
+void jit_load(char *path);
+void init_cache();
+unsigned long hash_bytes(unsigned long h, void *p, long len);
+unsigned long hash_function(int *end);
+void cache_scan();
+Function *cache_function(int i);
+void cache_output(Function *fn, Buffer *out, Object *obj);
+void cache_store(Function *fn, Buffer *out, Object *obj);
+void cache_evict();
+void cache_report();
+int jit_run(Object *obj);
+void buf_reserve(Buffer *buf, int len);
+void buf_write(Buffer *buf, char *s, int len);
+void buf_str(Buffer *buf, char *s);
+void buf_char(Buffer *buf, char c);
+void buf_int(Buffer *buf, long val);
+void buf_label(Buffer *buf, char *fn, int label);
+void write_output(Buffer *buf, char *path);
+int compile(Buffer *out);
+void compile_reset();
+void serve(char *path);
+int client(char *path);
 
 // Global variables
-extern Token *current_token;
-extern char *user_input;
\ No newline at end of file
+extern _Thread_local Token *tokens;
+extern _Thread_local int ntokens;
+extern _Thread_local int current_token;
+extern _Thread_local char *user_input;
+extern _Thread_local char *user_input_end;
+extern _Thread_local char *input_path;
+extern _Thread_local FILE *error_out;
+extern _Thread_local jmp_buf *error_jmp;
+
+// Statistics
+extern _Thread_local int node_count[];
+extern _Thread_local int var_count;
+extern _Thread_local int fn_count;
+extern long inst_count;
+
+// Options
+extern bool opt_fold;
+extern bool opt_peephole;
+extern char *opt_output;
+extern _Thread_local bool opt_obj;
+extern bool opt_run;
+extern int opt_jobs;
+extern char *opt_cache_dir;
+extern long opt_cache_size;
+extern bool opt_cache_stats;
+extern bool opt_mem_report;
+extern bool opt_time_report;
+extern bool opt_time_report_json;
+extern bool opt_simd;
+extern bool opt_ir_opt;
+extern bool opt_loop_opt;
+extern bool opt_inline;
+extern int opt_inline_limit;
+extern bool opt_tail_calls;
+extern bool opt_stack_reuse;
+extern bool opt_leaf_opt;
+extern bool opt_mem2reg;
+extern char *opt_profile_generate;
+extern char *opt_profile_use;
+extern bool opt_dump_ir;
+extern bool opt_server;
+
+// Profile
+extern unsigned long profile_hash;
+extern ProfFunc *prof_funcs;
+extern int nprof_func;
+extern int nprof_counter;
+extern long *profile_counts;
+
+// Arenas
+extern _Thread_local Arena lex_arena;
+extern _Thread_local Arena parse_arena;
+extern _Thread_local Arena codegen_arena;
\ No newline at end of file
@@ -0,0 +1,75 @@
+#include "9cc.h"
+
+#define CHUNK_SIZE (64 * 1024)
+#define ALIGN 16
+
+// arenas per compiler phase (front end runs on thread of request)
+_Thread_local Arena lex_arena = {"lex"};
+_Thread_local Arena parse_arena = {"parse"};
+_Thread_local Arena codegen_arena = {"codegen"};
+
+// chunk of arena memory
+typedef struct Chunk Chunk;
+struct Chunk {
+    Chunk *next; // Previous chunk
+    long size; // Usable size
+    _Alignas(ALIGN) char data[]; // Memory
+};
+
+// get zeroed memory from arena
+void *arena_alloc(Arena *arena, long size) {
+    size = (size + ALIGN - 1) & ~(long)(ALIGN - 1);
+
+    if (!arena->ptr || arena->ptr + size > arena->end) {
+        long chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+        Chunk *chunk = malloc(sizeof(Chunk) + chunk_size);
+        if (!chunk)
+            error("out of memory");
+        chunk->next = arena->chunks;
+        chunk->size = chunk_size;
+        arena->chunks = chunk;
+        arena->ptr = chunk->data;
+        arena->end = chunk->data + chunk_size;
+        arena->reserved += chunk_size;
+    }
+
+    void *p = arena->ptr;
+    arena->ptr += size;
+    arena->bytes += size;
+    arena->objects++;
+    memset(p, 0, size);
+    return p;
+}
+
+// copy string into arena
+char *arena_strndup(Arena *arena, char *s, int len) {
+    char *p = arena_alloc(arena, len + 1);
+    memcpy(p, s, len);
+    return p;
+}
+
+// release all memory of arena at once
+void arena_free(Arena *arena) {
+    for (Chunk *chunk = arena->chunks; chunk; ) {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->ptr = arena->end = NULL;
+    arena->freed += arena->bytes;
+    arena->bytes = 0;
+}
+
+// add counters of freed arena to arena of another thread
+void arena_merge(Arena *dst, Arena *src) {
+    dst->freed += src->freed;
+    dst->objects += src->objects;
+    dst->reserved += src->reserved;
+}
+
+// report counters of arena
+void arena_report(Arena *arena) {
+    fprintf(stderr, "%-8s %10ld bytes %8ld objects %10ld reserved\n",
+            arena->name, arena->bytes + arena->freed, arena->objects, arena->reserved);
+}
@@ -0,0 +1,73 @@
+#!/bin/bash
+# Measure compile throughput per phase on synthetic programs.
+# Prints CSV to stdout; REPEAT sets runs per case (best run is kept).
+
+cd "$(dirname "$0")/.."
+REPEAT=${REPEAT:-3}
+
+# shape and input sizes
+CASES="
+functions 1000 4000 16000
+expr 250 1000 4000
+stmts 5000 20000 80000
+locals 1000 4000 16000
+loops 2000 8000 32000
+"
+
+echo "shape,size,input_bytes,output_bytes,tokens,nodes,phase,wall_ms,cpu_ms,tokens_per_sec,nodes_per_sec,output_bytes_per_sec"
+
+echo "$CASES" | while read -r shape sizes; do
+	[ "$shape" ] || continue
+	for size in $sizes; do
+		./bench/gen "$shape" "$size" > tmp.bench.in
+		for i in $(seq "$REPEAT"); do
+			./9cc -ftime-report=json -o tmp.bench.s tmp.bench.in 2>&1 >/dev/null || exit 1
+		done > tmp.bench.json || exit 1
+		awk -v shape="$shape" -v size="$size" \
+			-v input="$(wc -c < tmp.bench.in)" -v output="$(wc -c < tmp.bench.s)" '
+		function num(key,    m) {
+			if (!match($0, "\"" key "\": [0-9.]+"))
+				return -1;
+			m = substr($0, RSTART, RLENGTH);
+			sub(/.*: /, "", m);
+			return m + 0;
+		}
+		/"name":/ {
+			name = $0;
+			sub(/.*"name": "/, "", name);
+			sub(/".*/, "", name);
+			if (!(name in cpu)) {
+				order[n++] = name;
+				cpu[name] = wall[name] = -1;
+			}
+			c = num("cpu_ms");
+			w = num("wall_ms");
+			if (cpu[name] < 0 || c < cpu[name])
+				cpu[name] = c;
+			if (w >= 0 && (wall[name] < 0 || w < wall[name]))
+				wall[name] = w;
+		}
+		/"tokens":/ {
+			tokens = num("tokens");
+			line = $0;
+			sub(/.*"nodes": \{/, "", line);
+			nodes = 0;
+			k = split(line, parts, /[,}]/);
+			for (j = 1; j <= k; j++)
+				if (split(parts[j], kv, ": ") == 2)
+					nodes += kv[2];
+		}
+		END {
+			for (i = 0; i < n; i++) {
+				name = order[i];
+				t = ((wall[name] < 0) ? cpu[name] : wall[name]) / 1000;
+				if (t <= 0)
+					t = 1e-9;
+				w = (wall[name] < 0) ? "" : sprintf("%.3f", wall[name]);
+				printf "%s,%d,%d,%d,%d,%d,%s,%s,%.3f,%.0f,%.0f,%.0f\n", shape, size, input, output,
+					tokens, nodes, name, w, cpu[name], tokens / t, nodes / t, output / t;
+			}
+		}' tmp.bench.json
+	done
+done
+rm -f tmp.bench.in tmp.bench.s tmp.bench.json
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Generate synthetic program of given shape and size on stdout.
+
+// many small functions called from main
+void gen_functions(int n) {
+    for (int i = 0; i < n; i++)
+        printf("f%d(a, b) {x=a*%d+b; if (x<b) return x; return x-b;}\n", i, i % 97);
+    printf("main() {s=0;\n");
+    for (int i = 0; i < n; i++)
+        printf("s=s+f%d(%d, %d);\n", i, i % 7, i % 5);
+    printf("return s;}\n");
+}
+
+// deeply nested expression
+void gen_expr(int n) {
+    printf("main() {x=3; return ");
+    for (int i = 0; i < n; i++)
+        printf("%s(x%s", i % 2 ? "x-" : "1+", i % 3 ? "*" : "+");
+    printf("1");
+    for (int i = 0; i < n; i++)
+        printf(")");
+    printf(";}\n");
+}
+
+// long straight-line statement list
+void gen_stmts(int n) {
+    printf("main() {a=1; b=2;\n");
+    for (int i = 0; i < n; i++)
+        printf("a=a+b*%d; b=a-%d;\n", i % 13, i % 11);
+    printf("return a;}\n");
+}
+
+// many locals in one function
+void gen_locals(int n) {
+    printf("main() {v0=1;\n");
+    for (int i = 1; i < n; i++)
+        printf("v%d=v%d+%d;\n", i, i - 1, i % 17);
+    printf("return v%d;}\n", n - 1);
+}
+
+// long for and while bodies
+void gen_loops(int n) {
+    printf("main() {a=0; b=1;\nfor (i=0; i<10; i=i+1) {\n");
+    for (int i = 0; i < n / 2; i++)
+        printf("a=a+i*%d; if (a>%d) b=b+1;\n", i % 7, i);
+    printf("}\nj=0;\nwhile (j<10) {\n");
+    for (int i = 0; i < n - n / 2; i++)
+        printf("b=b+j-%d; if (b<0) a=a-1;\n", i % 5);
+    printf("j=j+1;}\nreturn a+b;}\n");
+}
+
+int main(int argc, char **argv) {
+    static struct {
+        char *name;
+        void (*gen)(int n);
+    } shapes[] = {
+        {"functions", gen_functions},
+        {"expr", gen_expr},
+        {"stmts", gen_stmts},
+        {"locals", gen_locals},
+        {"loops", gen_loops},
+    };
+
+    if (argc == 3) {
+        for (int i = 0; i < sizeof(shapes) / sizeof(*shapes); i++) {
+            if (!strcmp(argv[1], shapes[i].name)) {
+                shapes[i].gen(atoi(argv[2]));
+                return 0;
+            }
+        }
+    }
+    fprintf(stderr, "usage: gen (functions | expr | stmts | locals | loops) <size>\n");
+    return 1;
+}
@@ -1,241 +1,878 @@
 #include "9cc.h"
+#include <pthread.h>
+#include <unistd.h>
 
-int seq_label = 0;
-char *arg_reg[] = {
-    "rdi",
-    "rsi",
-    "rdx",
-    "rcx",
-    "r8",
-    "r9"
+Reg arg_reg[] = {RDI, RSI, RDX, RCX, R8, R9};
+char *reg64[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+    "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
 };
-Function *current_fn;
+// symbols of counters, strings and writer in instrumented program
+#define PROF_COUNTS ".Lprof.counts"
+#define PROF_STRINGS ".Lprof.strings"
+#define PROF_WRITE ".Lprof.write"
+#define PROF_INIT ".Lprof.init"
 
-void gen_code(Node *node);
+char *reg8[] = {
+    "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+    "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+};
+
+// code generation state of current function (one per thread)
+_Thread_local Function *current_fn;
+_Thread_local int seq_label; // Next label number in function
+_Thread_local Inst inst_head;
+_Thread_local Inst *inst_tail;
+_Thread_local int nvreg;
+_Thread_local int return_label;
+
+Inst *new_inst(InstPattern pattern, Operand dst, Operand src) {
+    Inst *in = arena_alloc(&codegen_arena, sizeof(Inst));
+    in->pattern = pattern;
+    in->dst = dst;
+    in->src = src;
+    return in;
+}
+
+// append instruction to current function
+Inst *emit(InstPattern pattern, Operand dst, Operand src) {
+    Inst *in = new_inst(pattern, dst, src);
+    inst_tail->next = in;
+    inst_tail = in;
+    return in;
+}
+
+void emit_label(InstPattern pattern, int label) {
+    emit(pattern, (Operand){}, (Operand){})->label = label;
+}
+
+void emit_jcc(CondCode cc, int label) {
+    Inst *in = emit(IN_JCC, (Operand){}, (Operand){});
+    in->cc = cc;
+    in->label = label;
+}
+
+int new_vreg() {
+    return ++nvreg;
+}
+
+Operand reg(Reg reg) {
+    return (Operand){OP_REG, reg, 0};
+}
+
+Operand vreg(int vreg) {
+    return (Operand){OP_VREG, vreg, 0};
+}
+
+Operand imm(long val) {
+    return (Operand){OP_IMM, 0, val};
+}
+
+Operand mem(Reg base, long disp) {
+    return (Operand){OP_MEM, base, disp};
+}
+
+Operand vmem(int vreg, long disp) {
+    return (Operand){OP_VMEM, vreg, disp};
+}
+
+Operand sym_mem(char *sym, long disp) {
+    return (Operand){OP_SYM, 0, disp, sym};
+}
 
 // allocate variables memory
 void allocate_memory(Function *fn) {
     int allocate_size = 0;
     for (VarList *vl = fn->var_list; vl; vl = vl->next) {
+        if (vl->var->vreg)
+            continue;
         allocate_size += 8;
         vl->var->offset = allocate_size;
     }
-    printf("    push rbp\n");
-    printf("    mov rbp, rsp\n");
-    printf("    sub rsp, %d\n", allocate_size);
+    fn->stack_size = allocate_size;
 }
 
-// push arguments to stack
+// push arguments to stack or copy them to registers of variables
 void load_args(Function *fn) {
-    int i = 0;
+    int i = 0, rdx = 0;
     for (VarList *params = fn->params; params; params = params->next) {
         Var *var = params->var;
-        printf("    mov [rbp-%d], %s\n", var->offset, arg_reg[i++]);
+        Reg r = arg_reg[i++];
+        if (!var->vreg)
+            emit(IN_MOV, mem(RBP, -var->offset), reg(r));
+        else if (r == RDX)
+            rdx = var->vreg;
+        else
+            emit(IN_MOV, vreg(var->vreg), reg(r));
     }
+
+    // rdx is scratch, so it is copied once other arguments are in place
+    if (rdx)
+        emit(IN_MOV, vreg(rdx), reg(RDX));
 }
 
-// load variable
-void load_var() {
-    printf("    pop rax\n");
-    printf("    mov rax, [rax]\n");
-    printf("    push rax\n");
+// machine virtual register of each IR value
+_Thread_local int *value_vreg;
+_Thread_local int *value_uses;
+_Thread_local IR **value_def;
+_Thread_local BasicBlock *next_bb; // Block laid out after one being selected
+
+int vreg_of(int value) {
+    if (!value_vreg[value])
+        value_vreg[value] = new_vreg();
+    return value_vreg[value];
 }
 
-// store variable
-void store_var() {
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    mov [rax], rdi\n");
-    printf("    push rdi\n");
+// start two-address operation on a, reusing its register if this is its only use
+int two_address(IR *ir) {
+    if (value_uses[ir->a] == 1 && ir->a != ir->b) {
+        value_vreg[ir->dst] = vreg_of(ir->a);
+        return value_vreg[ir->dst];
+    }
+    int d = vreg_of(ir->dst);
+    emit(IN_MOV, vreg(d), vreg(vreg_of(ir->a)));
+    return d;
 }
 
-void gen_addr(Node *node) {
-    switch (node->pattern) {
-    case ND_VAR:
-        printf("    lea rax, [rbp-%d]\n", node->var->offset);
-        printf("    push rax\n");
-        return;
-    case ND_DEREF:
-        gen_code(node->lhs);
+// constant defining value if it fits in immediate operand
+bool imm_value(int value, long *val) {
+    IR *def = value_def[value];
+    if (!def || def->pattern != IR_IMM || !is_imm32(def->imm))
+        return false;
+    *val = def->imm;
+    return true;
+}
+
+// operand of value, immediate if constant
+Operand value_operand(int value) {
+    long val;
+    if (imm_value(value, &val))
+        return imm(val);
+    return vreg(vreg_of(value));
+}
+
+// variable held in register whose address is value (NULL if none)
+Var *reg_var(int value) {
+    IR *def = value_def[value];
+    return def && def->pattern == IR_LVAR && def->var->vreg ? def->var : NULL;
+}
+
+// k of power of two 2^k (0 if other)
+int shift_of(long val) {
+    if (val < 2 || (val & (val - 1)))
+        return 0;
+    return __builtin_ctzl(val);
+}
+
+// multiplier m and shift s such that n / d is high half of m * n shifted
+// right by s, plus 1 if n is negative (Hacker's Delight 10-1, d >= 3)
+void div_magic(long d, long *m, int *s) {
+    unsigned long two63 = 1UL << 63, ad = d;
+    unsigned long anc = two63 - 1 - two63 % ad;
+    unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad, r2 = two63 - q2 * ad;
+    unsigned long delta;
+    int p = 63;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *m = q2 + 1;
+    *s = p - 64;
+}
+
+// signed division by constant d >= 2 without idiv
+void select_div_const(IR *ir, long d) {
+    int x = vreg_of(ir->a);
+    int q = vreg_of(ir->dst);
+
+    // round toward zero by adding d - 1 to negative dividend
+    int k = shift_of(d);
+    if (k) {
+        emit(IN_MOV, vreg(q), vreg(x));
+        emit(IN_SAR, vreg(q), imm(63));
+        emit(IN_SHR, vreg(q), imm(64 - k));
+        emit(IN_ADD, vreg(q), vreg(x));
+        emit(IN_SAR, vreg(q), imm(k));
         return;
     }
-    error("not an left value");
+
+    long m;
+    int s;
+    div_magic(d, &m, &s);
+    emit(IN_MOV, reg(RAX), imm(m));
+    emit(IN_IMULH, (Operand){}, vreg(x));
+    if (m < 0)
+        emit(IN_ADD, reg(RDX), vreg(x));
+    if (s)
+        emit(IN_SAR, reg(RDX), imm(s));
+    emit(IN_MOV, reg(RAX), reg(RDX));
+    emit(IN_SHR, reg(RAX), imm(63));
+    emit(IN_ADD, reg(RDX), reg(RAX));
+    emit(IN_MOV, vreg(q), reg(RDX));
 }
 
-void gen_code(Node *node) {
-    switch (node->pattern) {
-    case ND_NUM:
-        printf("    push %d\n", node->val);
+// select machine instructions for IR instruction
+void select_inst(IR *ir) {
+    static InstPattern arith[] = {[IR_ADD] = IN_ADD, [IR_SUB] = IN_SUB, [IR_MUL] = IN_IMUL};
+    static CondCode cc[] = {[IR_EQ] = CC_E, [IR_NE] = CC_NE, [IR_LT] = CC_L, [IR_LE] = CC_LE};
+    static CondCode swapped_cc[] = {[IR_EQ] = CC_E, [IR_NE] = CC_NE, [IR_LT] = CC_G, [IR_LE] = CC_GE};
+    long val;
+
+    switch (ir->pattern) {
+    case IR_IMM:
+        emit(IN_MOV, vreg(vreg_of(ir->dst)), imm(ir->imm));
         return;
-    case ND_VAR:
-        gen_addr(node);
-        load_var();
+    case IR_LVAR:
+        if (ir->var->vreg)
+            return;
+        emit(IN_LEA, vreg(vreg_of(ir->dst)), mem(RBP, -ir->var->offset));
         return;
-    case ND_ASSIGN:
-        gen_addr(node->lhs);
-        gen_code(node->rhs);
-        store_var();
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL: {
+        // constant goes to right of commutative operation
+        if (ir->pattern != IR_SUB && imm_value(ir->a, &val) && !imm_value(ir->b, &val)) {
+            int a = ir->a;
+            ir->a = ir->b;
+            ir->b = a;
+        }
+        if (!imm_value(ir->b, &val)) {
+            int b = vreg_of(ir->b);
+            emit(arith[ir->pattern], vreg(two_address(ir)), vreg(b));
+            return;
+        }
+        if (ir->pattern == IR_MUL && shift_of(val)) {
+            emit(IN_SHL, vreg(two_address(ir)), imm(shift_of(val)));
+            return;
+        }
+
+        // lea leaves operand which is still used intact
+        long disp = ir->pattern == IR_ADD ? val : -val;
+        if (ir->pattern != IR_MUL && value_uses[ir->a] > 1 && is_imm32(disp)) {
+            emit(IN_LEA, vreg(vreg_of(ir->dst)), vmem(vreg_of(ir->a), disp));
+            return;
+        }
+        emit(arith[ir->pattern], vreg(two_address(ir)), imm(val));
         return;
-    case ND_ADDR:
-        gen_addr(node->lhs);
+    }
+    case IR_NEG:
+        emit(IN_NEG, vreg(two_address(ir)), (Operand){});
         return;
-    case ND_DEREF:
-        gen_code(node->lhs);
-        load_var();
+    case IR_DIV:
+        if (imm_value(ir->b, &val) && val >= 2) {
+            select_div_const(ir, val);
+            return;
+        }
+        emit(IN_MOV, reg(RAX), vreg(vreg_of(ir->a)));
+        emit(IN_CQO, (Operand){}, (Operand){});
+        emit(IN_IDIV, (Operand){}, vreg(vreg_of(ir->b)));
+        emit(IN_MOV, vreg(vreg_of(ir->dst)), reg(RAX));
         return;
-    case ND_IF:
-        if (node->els) {
-            gen_code(node->cond);
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lelse%d\n", seq_label);
-            gen_code(node->then);
-            printf("    jmp .Lend%d\n", seq_label);
-            printf(".Lelse%d:\n", seq_label);
-            gen_code(node->els);
-            printf(".Lend%d:\n", seq_label);
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE: {
+        int d = vreg_of(ir->dst);
+        CondCode c = cc[ir->pattern];
+        if (imm_value(ir->b, &val) || !imm_value(ir->a, &val)) {
+            emit(IN_CMP, vreg(vreg_of(ir->a)), value_operand(ir->b));
         } else {
-            gen_code(node->cond);
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lend%d\n", seq_label);
-            gen_code(node->then);
-            printf(".Lend%d:\n", seq_label);
-        }
-        seq_label++;
-        return;
-    case ND_WHILE:
-        printf(".Lbegin%d:\n", seq_label);
-        gen_code(node->cond);
-        printf("    pop rax\n");
-        printf("    cmp rax, 0\n");
-        printf("    je .Lend%d\n", seq_label);
-        gen_code(node->then);
-        printf("    jmp .Lbegin%d\n", seq_label);
-        printf(".Lend%d:\n", seq_label);
-        seq_label++;
-        return;
-    case ND_FOR:
-        if (node->init)
-            gen_code(node->init);
-        printf(".Lbegin%d:\n", seq_label);
-        if (node->cond) {
-            gen_code(node->cond);
-            printf("    pop rax\n");
-            printf("    cmp rax, 0\n");
-            printf("    je .Lend%d\n", seq_label);
-        }
-        gen_code(node->then);
-        if (node->inc)
-            gen_code(node->inc);
-        printf("    jmp .Lbegin%d\n", seq_label);
-        printf(".Lend%d:\n", seq_label);
-        return;
-    case ND_RETURN:
-        gen_code(node->lhs);
-        printf("    pop rax\n");
-        printf("    jmp .Lreturn.%s\n", current_fn->name);
-        return;
-    case ND_BLOCK:
-        for (Node *n = node->stmts; n; n = n->next)
-            gen_code(n);
-        return;
-    case ND_FUNCALL:
-        // generate values and count args
-        int argc = 0;
-        for (Node *arg = node->args; arg; arg = arg->next) {
-            gen_code(arg);
-            argc++;
+            emit(IN_CMP, vreg(vreg_of(ir->b)), imm(val));
+            c = swapped_cc[ir->pattern];
         }
-
+        emit(IN_SETCC, vreg(d), (Operand){})->cc = c;
+        emit(IN_MOVZB, vreg(d), vreg(d));
+        return;
+    }
+    case IR_COPY:
+        emit(IN_MOV, vreg(vreg_of(ir->dst)), vreg(vreg_of(ir->a)));
+        return;
+    case IR_LOAD:
+        if (reg_var(ir->a)) {
+            emit(IN_MOV, vreg(vreg_of(ir->dst)), vreg(reg_var(ir->a)->vreg));
+            return;
+        }
+        emit(IN_MOV, vreg(vreg_of(ir->dst)), vmem(vreg_of(ir->a), 0));
+        return;
+    case IR_STORE:
+        if (reg_var(ir->a)) {
+            emit(IN_MOV, vreg(reg_var(ir->a)->vreg), value_operand(ir->b));
+            return;
+        }
+        emit(IN_MOV, vmem(vreg_of(ir->a), 0), value_operand(ir->b));
+        return;
+    case IR_CALL: {
         // set values to registers by following System V AMD64 ABI
-        for (int i = argc - 1; i >= 0; i--)
-            printf("    pop %s\n", arg_reg[i]);
-
-        // align RSP to a 16 byte boundary
-        printf("    mov rax, rsp\n");
-        printf("    and rax, 15\n");
-        printf("    jnz .Lcall%d\n", seq_label); // if RSP is NOT a 16 byte
-        printf("    xor rax, rax\n");
-        printf("    call %s\n", node->fn_name);
-        printf("    jmp .Lend%d\n", seq_label);
-        printf(".Lcall%d:\n", seq_label);
-        printf("    sub rsp, 8\n");
-        printf("    xor rax, rax\n");
-        printf("    call %s\n", node->fn_name);
-        printf("    add rsp, 8\n");
-        printf(".Lend%d:\n", seq_label);
-        printf("    push rax\n");
-        seq_label++;
-        return;
-    }
-
-    gen_code(node->lhs);
-    gen_code(node->rhs);
-
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-
-    switch (node->pattern) {
-    case ND_ADD:
-        printf("    add rax, rdi\n");
-        break;
-    case ND_SUB:
-        printf("    sub rax, rdi\n");
-        break;
-    case ND_MUL:
-        printf("    imul rax, rdi\n");
-        break;
-    case ND_DIV:
-        printf("    cqo\n");
-        printf("    idiv rdi\n");
-        break;
-    case ND_EQ:
-        printf("    cmp rax, rdi\n");
-        printf("    sete al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_NE:
-        printf("    cmp rax, rdi\n");
-        printf("    setne al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_LT:
-        printf("    cmp rax, rdi\n");
-        printf("    setl al\n");
-        printf("    movzb rax, al\n");
-        break;
-    case ND_LE:
-        printf("    cmp rax, rdi\n");
-        printf("    setle al\n");
-        printf("    movzb rax, al\n");
-        break;
-    }
-
-    printf("    push rax\n");
-}
-
-void build(Function *program) {
-    // prefix
-    printf(".intel_syntax noprefix\n");
-
-    for (Function *fn = program; fn; fn = fn->next) {
-        current_fn = fn;
-
-        // function declare
-        printf(".global %s\n", fn->name);
-        printf("%s:\n", fn->name);
+        for (int i = 0; i < ir->nargs; i++)
+            emit(IN_MOV, reg(arg_reg[i]), value_operand(ir->args[i]));
+
+        emit(IN_CALL, (Operand){}, (Operand){})->sym = ir->sym;
+        emit(IN_MOV, vreg(vreg_of(ir->dst)), reg(RAX));
+        return;
+    }
+    case IR_TAILCALL:
+        for (int i = 0; i < ir->nargs; i++)
+            emit(IN_MOV, reg(arg_reg[i]), value_operand(ir->args[i]));
+        emit(IN_TAILCALL, (Operand){}, (Operand){})->sym = ir->sym;
+        return;
+    case IR_JMP:
+        emit_label(IN_JMP, ir->then->label);
+        return;
+    case IR_BR:
+        // block laid out next is reached by falling through
+        emit(IN_CMP, vreg(vreg_of(ir->a)), imm(0));
+        if (next_bb == ir->els) {
+            emit_jcc(CC_NE, ir->then->label);
+            emit_label(IN_JMP, ir->els->label);
+            return;
+        }
+        emit_jcc(CC_E, ir->els->label);
+        emit_label(IN_JMP, ir->then->label);
+        return;
+    case IR_RET:
+        if (ir->a)
+            emit(IN_MOV, reg(RAX), value_operand(ir->a));
+        emit_label(IN_JMP, return_label);
+        return;
+    case IR_COUNT:
+        emit(IN_ADD, sym_mem(PROF_COUNTS, ir->imm), imm(1));
+        return;
+    }
+}
+
+// translate IR of function into instructions on virtual registers
+void select_function(IRFunc *fn) {
+    value_vreg = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    value_uses = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    value_def = value_defs(fn);
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        bb->label = seq_label++;
+        for (IR *ir = bb->ir; ir; ir = ir->next) {
+            int *opd[6];
+            int nopd = ir_operands(ir, opd);
+            for (int i = 0; i < nopd; i++)
+                value_uses[*opd[i]]++;
+        }
+    }
+
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        emit_label(IN_LABEL, bb->label);
+        next_bb = bb->next;
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+            select_inst(ir);
+    }
+}
+
+// write operand (size is omitted for lea)
+void out_operand(Buffer *buf, Operand op, char *size) {
+    switch (op.pattern) {
+    case OP_REG:
+        buf_str(buf, strcmp(size, "BYTE") ? reg64[op.reg] : reg8[op.reg]);
+        return;
+    case OP_IMM:
+        buf_int(buf, op.val);
+        return;
+    case OP_MEM:
+    case OP_SYM:
+        if (*size) {
+            buf_str(buf, size);
+            buf_str(buf, " PTR ");
+        }
+        buf_char(buf, '[');
+        if (op.pattern == OP_SYM) {
+            buf_str(buf, "rip+");
+            buf_str(buf, op.sym);
+        } else {
+            buf_str(buf, reg64[op.reg]);
+        }
+        if (op.val > 0)
+            buf_char(buf, '+');
+        if (op.val)
+            buf_int(buf, op.val);
+        buf_char(buf, ']');
+        return;
+    }
+    error("unallocated operand");
+}
+
+// write "    op operand\n"
+void out_unary(Buffer *buf, char *op, Operand opd, char *size) {
+    buf_str(buf, "    ");
+    buf_str(buf, op);
+    buf_char(buf, ' ');
+    out_operand(buf, opd, size);
+    buf_char(buf, '\n');
+}
+
+// write "    op label\n"
+void out_jump(Buffer *buf, char *op, int label) {
+    buf_str(buf, "    ");
+    buf_str(buf, op);
+    buf_char(buf, ' ');
+    buf_label(buf, current_fn->name, label);
+    buf_char(buf, '\n');
+}
+
+void out_label(Buffer *buf, int label) {
+    buf_label(buf, current_fn->name, label);
+    buf_str(buf, ":\n");
+}
+
+void out_inst(Buffer *buf, Inst *in) {
+    static char *name[] = {
+        [IN_MOV] = "mov", [IN_LEA] = "lea", [IN_ADD] = "add", [IN_SUB] = "sub",
+        [IN_IMUL] = "imul", [IN_CMP] = "cmp", [IN_MOVZB] = "movzb",
+        [IN_SHL] = "shl", [IN_SAR] = "sar", [IN_SHR] = "shr",
+    };
+    static char *jcc_name[] = {"je", "jne", "jl", "jle", "jg", "jge"};
+    static char *setcc_name[] = {"sete", "setne", "setl", "setle", "setg", "setge"};
+
+    switch (in->pattern) {
+    case IN_CQO:
+        buf_str(buf, "    cqo\n");
+        return;
+    case IN_IDIV:
+        out_unary(buf, "idiv", in->src, "QWORD");
+        return;
+    case IN_IMULH:
+        out_unary(buf, "imul", in->src, "QWORD");
+        return;
+    case IN_NEG:
+        out_unary(buf, "neg", in->dst, "QWORD");
+        return;
+    case IN_SETCC:
+        out_unary(buf, setcc_name[in->cc], in->dst, "BYTE");
+        return;
+    case IN_PUSH:
+        out_unary(buf, "push", in->src, "QWORD");
+        return;
+    case IN_POP:
+        out_unary(buf, "pop", in->dst, "QWORD");
+        return;
+    case IN_JMP:
+        out_jump(buf, "jmp", in->label);
+        return;
+    case IN_JCC:
+        out_jump(buf, jcc_name[in->cc], in->label);
+        return;
+    case IN_LABEL:
+        out_label(buf, in->label);
+        return;
+    case IN_RET:
+        buf_str(buf, "    ret\n");
+        return;
+    case IN_GLOBAL:
+        buf_str(buf, ".global ");
+        buf_str(buf, in->sym);
+        buf_char(buf, '\n');
+        return;
+    case IN_SYMBOL:
+        buf_str(buf, in->sym);
+        buf_str(buf, ":\n");
+        return;
+    case IN_CALL:
+        buf_str(buf, "    xor rax, rax\n");
+        buf_str(buf, "    call ");
+        buf_str(buf, in->sym);
+        buf_char(buf, '\n');
+        return;
+    case IN_TAILCALL:
+        buf_str(buf, "    xor rax, rax\n");
+        buf_str(buf, "    jmp ");
+        buf_str(buf, in->sym);
+        buf_char(buf, '\n');
+        return;
+    }
+
+    buf_str(buf, "    ");
+    buf_str(buf, name[in->pattern]);
+    buf_char(buf, ' ');
+    out_operand(buf, in->dst, "QWORD");
+    buf_str(buf, ", ");
+    out_operand(buf, in->src, in->pattern == IN_MOVZB ? "BYTE" : in->pattern == IN_LEA ? "" : "QWORD");
+    buf_char(buf, '\n');
+}
+
+// append instructions to list and return its tail
+Inst *append_list(Inst *cur, Inst *insts) {
+    cur->next = insts;
+    while (cur->next)
+        cur = cur->next;
+    return cur;
+}
+
+// bytes which leaf function reserves below RSP (frame fits in red zone if 0)
+int leaf_frame_size(RegAlloc *ra) {
+    return ra->stack_size > 128 ? ra->stack_size : 0;
+}
+
+// address slot [rbp-d] of leaf function relative to RSP
+Operand leaf_operand(Operand op, int size) {
+    if (op.pattern == OP_MEM && op.reg == RBP)
+        return mem(RSP, op.val + size);
+    return op;
+}
+
+// restore callee-saved registers and leave frame
+void emit_epilogue(Function *fn, RegAlloc *ra) {
+    for (int r = 0; r < 16; r++)
+        if (ra->save_offset[r])
+            emit(IN_MOV, reg(r), mem(RBP, -ra->save_offset[r]));
+    if (fn->leaf) {
+        if (leaf_frame_size(ra))
+            emit(IN_ADD, reg(RSP), imm(leaf_frame_size(ra)));
+        return;
+    }
+    emit(IN_MOV, reg(RSP), reg(RBP));
+    emit(IN_POP, reg(RBP), (Operand){});
+}
+
+// wrap body of function with declaration, prologue and epilogue
+Inst *gen_frame(Function *fn, RegAlloc *ra) {
+    Inst head = {};
+    inst_tail = &head;
+
+    // function declare
+    emit(IN_GLOBAL, (Operand){}, (Operand){})->sym = fn->name;
+    emit(IN_SYMBOL, (Operand){}, (Operand){})->sym = fn->name;
+
+    // prologue (leaf function sets up no frame pointer)
+    if (!fn->leaf) {
+        emit(IN_PUSH, (Operand){}, reg(RBP));
+        emit(IN_MOV, reg(RBP), reg(RSP));
+        emit(IN_SUB, reg(RSP), imm(ra->stack_size));
+    } else if (leaf_frame_size(ra)) {
+        emit(IN_SUB, reg(RSP), imm(leaf_frame_size(ra)));
+    }
+    for (int r = 0; r < 16; r++)
+        if (ra->save_offset[r])
+            emit(IN_MOV, mem(RBP, -ra->save_offset[r]), reg(r));
+
+    // tail calls leave frame before jumping
+    for (Inst *in = ra->insts; in; ) {
+        Inst *next = in->next;
+        if (in->pattern == IN_TAILCALL)
+            emit_epilogue(fn, ra);
+        inst_tail = inst_tail->next = in;
+        in->next = NULL;
+        in = next;
+    }
+
+    // epilogue
+    emit_epilogue(fn, ra);
+    emit(IN_RET, (Operand){}, (Operand){});
+
+    if (fn->leaf) {
+        for (Inst *in = head.next; in; in = in->next) {
+            in->dst = leaf_operand(in->dst, leaf_frame_size(ra));
+            in->src = leaf_operand(in->src, leaf_frame_size(ra));
+        }
+    }
+    return head.next;
+}
+
+// generate instructions of function
+Inst *gen_function(Function *fn) {
+    current_fn = fn;
+    inst_head.next = NULL;
+    inst_tail = &inst_head;
+    nvreg = 0;
+    seq_label = 0;
+    return_label = seq_label++;
+
+    // emit code
+    long t = phase_clock();
+    IRFunc *ir = lower_function(fn);
+    t = phase_lap(PH_LOWER, t);
+    run_ir_passes(ir);
+    t = phase_lap(PH_IR_OPT, t);
+
+    // variables live in registers unless some address escapes (leaf
+    // function keeps at least its parameters there)
+    fn->leaf = opt_leaf_opt && is_leaf(ir);
+    bool promote = opt_mem2reg && !address_escapes(ir, value_defs(ir));
+    for (VarList *vl = fn->var_list; vl; vl = vl->next)
+        vl->var->vreg = promote ? new_vreg() : 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+        if (fn->leaf && !vl->var->vreg)
+            vl->var->vreg = new_vreg();
+    if (opt_stack_reuse)
+        share_slots(fn, ir);
+    else
         allocate_memory(fn);
-        load_args(fn);
+    load_args(fn);
+    select_function(ir);
+    emit_label(IN_LABEL, return_label);
+    t = phase_lap(PH_ISEL, t);
+
+    Inst *insts = inst_head.next;
+    if (opt_peephole)
+        insts = peephole_vreg(insts, nvreg);
+    t = phase_lap(PH_PEEPHOLE, t);
+
+    RegAlloc ra = regalloc(insts, nvreg, fn->stack_size, fn->leaf);
+    insts = gen_frame(fn, &ra);
+    t = phase_lap(PH_REGALLOC, t);
+    if (opt_peephole)
+        insts = peephole(insts);
+    phase_lap(PH_PEEPHOLE, t);
+    return insts;
+}
+
+// add NUL-terminated string to buffer and return its offset
+int add_string(Buffer *buf, char *s) {
+    int offset = buf->len;
+    buf_write(buf, s, strlen(s) + 1);
+    return offset;
+}
+
+void emit_call(char *sym) {
+    emit(IN_CALL, (Operand){}, (Operand){})->sym = sym;
+}
 
-        // emit code
-        for (Node *n = fn->node; n; n = n->next)
-            gen_code(n);
+// generate constructor registering writer which appends line "name count..."
+// per function to profile at exit (strings it uses are added to buffer)
+Inst *gen_profile_writer(Buffer *strings) {
+    inst_head.next = NULL;
+    inst_tail = &inst_head;
+    seq_label = 0;
+    int path = add_string(strings, opt_profile_generate);
+    int mode = add_string(strings, "a");
+    int format = add_string(strings, " %ld");
 
-        // epilogue
-        printf(".Lreturn.%s:\n", current_fn->name);
-        printf("    mov rsp, rbp\n");
-        printf("    pop rbp\n");
-        printf("    ret\n");
+    emit(IN_SYMBOL, (Operand){}, (Operand){})->sym = PROF_INIT;
+    emit(IN_SUB, reg(RSP), imm(8));
+    emit(IN_LEA, reg(RDI), sym_mem(PROF_WRITE, 0));
+    emit_call("atexit");
+    emit(IN_ADD, reg(RSP), imm(8));
+    emit(IN_RET, (Operand){}, (Operand){});
+
+    // rbx holds file, r12 next counter and r13 counters left
+    emit(IN_SYMBOL, (Operand){}, (Operand){})->sym = PROF_WRITE;
+    emit(IN_PUSH, (Operand){}, reg(RBX));
+    emit(IN_PUSH, (Operand){}, reg(R12));
+    emit(IN_PUSH, (Operand){}, reg(R13));
+    emit(IN_LEA, reg(RDI), sym_mem(PROF_STRINGS, path));
+    emit(IN_LEA, reg(RSI), sym_mem(PROF_STRINGS, mode));
+    emit_call("fopen");
+    int done = seq_label++;
+    emit(IN_CMP, reg(RAX), imm(0));
+    emit_jcc(CC_E, done);
+    emit(IN_MOV, reg(RBX), reg(RAX));
+    for (int i = 0; i < nprof_func; i++) {
+        emit(IN_LEA, reg(RDI), sym_mem(PROF_STRINGS, add_string(strings, prof_funcs[i].name)));
+        emit(IN_MOV, reg(RSI), reg(RBX));
+        emit_call("fputs");
+        emit(IN_LEA, reg(R12), sym_mem(PROF_COUNTS, prof_funcs[i].offset * sizeof(long)));
+        emit(IN_MOV, reg(R13), imm(prof_funcs[i].n));
+        int loop = seq_label++;
+        emit_label(IN_LABEL, loop);
+        emit(IN_MOV, reg(RDI), reg(RBX));
+        emit(IN_LEA, reg(RSI), sym_mem(PROF_STRINGS, format));
+        emit(IN_MOV, reg(RDX), mem(R12, 0));
+        emit_call("fprintf");
+        emit(IN_ADD, reg(R12), imm(sizeof(long)));
+        emit(IN_SUB, reg(R13), imm(1));
+        emit_jcc(CC_NE, loop);
+        emit(IN_MOV, reg(RDI), imm('\n'));
+        emit(IN_MOV, reg(RSI), reg(RBX));
+        emit_call("fputc");
+    }
+    emit(IN_MOV, reg(RDI), reg(RBX));
+    emit_call("fclose");
+    emit_label(IN_LABEL, done);
+    emit(IN_POP, reg(R13), (Operand){});
+    emit(IN_POP, reg(R12), (Operand){});
+    emit(IN_POP, reg(RBX), (Operand){});
+    emit(IN_RET, (Operand){}, (Operand){});
+    return inst_head.next;
+}
+
+// write profile data of instrumented program as assembly
+void out_profile_data(Buffer *buf, Buffer *strings) {
+    buf_str(buf, ".section .init_array,\"aw\"\n.align 8\n.quad " PROF_INIT "\n");
+    buf_str(buf, ".section .rodata\n" PROF_STRINGS ":\n");
+    for (int i = 0; i < strings->len; i += strlen(strings->data + i) + 1) {
+        buf_str(buf, "    .string \"");
+        for (char *p = strings->data + i; *p; p++) {
+            if (*p == '"' || *p == '\\')
+                buf_char(buf, '\\');
+            buf_char(buf, *p);
+        }
+        buf_str(buf, "\"\n");
     }
-}
\ No newline at end of file
+    buf_str(buf, ".bss\n.align 8\n" PROF_COUNTS ":\n    .zero ");
+    buf_int(buf, nprof_counter * sizeof(long));
+    buf_char(buf, '\n');
+}
+
+// work shared by code generation threads of one build
+typedef struct GenJob GenJob;
+struct GenJob {
+    Function **fns; // Functions in source order
+    int nfn; // Number of functions
+    int next; // Next function to take
+    Buffer *out; // Assembly of each function
+    Object *obj; // Machine code of each function
+    bool obj_out; // Output kind of requesting thread
+    Arena *arena; // Arena of main thread receiving counters of workers
+    pthread_mutex_t lock;
+};
+
+// generate functions until none is left
+void *gen_worker(void *arg) {
+    GenJob *job = arg;
+    opt_obj = job->obj_out;
+
+    for (;;) {
+        int i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (i >= job->nfn)
+            break;
+
+        Function *fn = job->fns[i];
+        if (fn->cached.data) {
+            cache_output(fn, &job->out[i], &job->obj[i]);
+            continue;
+        }
+
+        Inst *insts = gen_function(fn);
+        long t = phase_clock();
+        if (opt_obj || opt_run)
+            encode_function(insts, &job->obj[i]);
+        else
+            for (Inst *in = insts; in; in = in->next)
+                out_inst(&job->out[i], in);
+        phase_lap(PH_EMIT, t);
+
+        if (opt_time_report) {
+            int n = 0;
+            for (Inst *in = insts; in; in = in->next)
+                n += in->pattern != IN_LABEL && in->pattern != IN_GLOBAL && in->pattern != IN_SYMBOL;
+            __atomic_fetch_add(&inst_count, n, __ATOMIC_RELAXED);
+        }
+        if (fn->cache_key)
+            cache_store(fn, &job->out[i], &job->obj[i]);
+    }
+
+    if (&codegen_arena != job->arena) {
+        arena_free(&codegen_arena);
+        pthread_mutex_lock(&job->lock);
+        arena_merge(job->arena, &codegen_arena);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// number of code generation threads
+int gen_threads(int nfn) {
+    int n = opt_jobs ? opt_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt_dump_ir || n < 1)
+        n = 1; // keep dumps in order
+    if (opt_server)
+        n = 1; // server runs requests in parallel and errors unwind their thread
+    if (n > nfn)
+        n = nfn;
+    return n;
+}
+
+// write assembly or object to buffer (or run program with --run) and return
+// exit status
+int build(Function *program, Buffer *buf) {
+    GenJob job = {};
+    for (Function *fn = program; fn; fn = fn->next)
+        job.nfn++;
+    job.fns = calloc(job.nfn + 1, sizeof(Function *));
+    job.nfn = 0;
+    for (Function *fn = program; fn; fn = fn->next)
+        job.fns[job.nfn++] = fn;
+    job.out = calloc(job.nfn + 1, sizeof(Buffer));
+    job.obj = calloc(job.nfn + 2, sizeof(Object)); // and writer of profile
+    job.obj_out = opt_obj;
+    job.arena = &codegen_arena;
+    pthread_mutex_init(&job.lock, NULL);
+
+    // main thread takes part as one of workers
+    int nthread = gen_threads(job.nfn);
+    pthread_t *threads = calloc(nthread + 1, sizeof(pthread_t));
+    for (int i = 1; i < nthread; i++)
+        if (pthread_create(&threads[i], NULL, gen_worker, &job))
+            error("cannot create thread");
+    gen_worker(&job);
+    for (int i = 1; i < nthread; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&job.lock);
+
+    // instrumented executable writes its own profile (program run by --run
+    // leaves its counters to compiler)
+    Inst *writer = NULL;
+    Buffer strings = {};
+    Function writer_fn = {.name = PROF_WRITE};
+    if (opt_profile_generate && !opt_run) {
+        current_fn = &writer_fn;
+        writer = gen_profile_writer(&strings);
+    }
+
+    // concatenate in source order
+    int status = 0;
+    if (opt_obj || opt_run) {
+        Object obj = {};
+        if (writer)
+            encode_function(writer, &job.obj[job.nfn]);
+        link_objects(job.obj, job.nfn + (writer != NULL), &obj);
+        if (opt_profile_generate) {
+            buf_write(&obj.rodata, strings.data, strings.len);
+            define_symbol(&obj, PROF_STRINGS, SC_RODATA, 0, strings.len);
+            obj.bss_size = nprof_counter * sizeof(long);
+            define_symbol(&obj, PROF_COUNTS, SC_BSS, 0, obj.bss_size);
+            obj.init_fn = writer ? PROF_INIT : NULL;
+        }
+        if (opt_run)
+            status = jit_run(&obj);
+        else
+            write_elf(&obj, buf);
+        free(obj.text.data);
+        free(obj.rodata.data);
+        free(obj.syms);
+        free(obj.relocs);
+    } else {
+        // prefix
+        buf_str(buf, ".intel_syntax noprefix\n");
+        for (int i = 0; i < job.nfn; i++)
+            buf_write(buf, job.out[i].data, job.out[i].len);
+        if (writer) {
+            for (Inst *in = writer; in; in = in->next)
+                out_inst(buf, in);
+            out_profile_data(buf, &strings);
+        }
+    }
+    free(strings.data);
+
+    for (int i = 0; i < job.nfn; i++) {
+        free(job.fns[i]->cached.data);
+        free(job.out[i].data);
+        free(job.obj[i].text.data);
+        free(job.obj[i].syms);
+        free(job.obj[i].relocs);
+    }
+    free(job.obj[job.nfn].text.data);
+    free(job.obj[job.nfn].syms);
+    free(job.obj[job.nfn].relocs);
+    free(job.out);
+    free(job.obj);
+    free(job.fns);
+    return status;
+}
@@ -0,0 +1,440 @@
+#include "9cc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// bump when generated code changes without rebuilding the compiler binary
+#define CACHE_VERSION 2
+#define CACHE_MAGIC 0x43433943 // "C9CC"
+
+// header of cache entry file
+typedef struct CacheHeader CacheHeader;
+struct CacheHeader {
+    unsigned magic; // CACHE_MAGIC
+    unsigned version; // CACHE_VERSION
+    unsigned long key; // Hash of function tokens, compiler and flags
+    long size; // Size of payload following header
+};
+
+// cache entry found on disk while evicting
+typedef struct CacheFile CacheFile;
+struct CacheFile {
+    char *name; // File name in cache directory
+    long size; // File size
+    struct timespec used; // Last use (modification time)
+};
+
+// function found by scanning tokens before parsing
+typedef struct ScanFunc ScanFunc;
+struct ScanFunc {
+    int end; // Token after body
+    unsigned long hash; // Hash of own tokens
+    int *callees; // Indices of called functions defined in file
+    int ncallee;
+    int index; // Visit order of SCC search (0 if not visited)
+    int low; // Lowest index reachable in SCC search
+    bool on_stack;
+    unsigned long key; // Key of cache entry (own hash and those reached)
+    Buffer cached; // Entry read from cache (empty on miss)
+    bool parse; // Tree is needed (missed or called by parsed function)
+};
+
+// functions of file in order
+_Thread_local ScanFunc *scan_funcs;
+_Thread_local int nscan_func;
+_Thread_local int *scan_stack;
+_Thread_local int scan_depth;
+_Thread_local int scan_index;
+
+// statistics
+int cache_hits;
+int cache_misses;
+int cache_stores;
+int cache_evictions;
+
+// hash of compiler binary and options affecting generated code
+unsigned long cache_seed;
+
+unsigned long hash_bytes(unsigned long h, void *p, long len) {
+    unsigned char *s = p;
+    for (long i = 0; i < len; i++)
+        h = (h ^ s[i]) * 0x100000001b3UL;
+    return h;
+}
+
+void init_cache() {
+    if (mkdir(opt_cache_dir, 0755) && errno != EEXIST)
+        error("cannot create %s: %s", opt_cache_dir, strerror(errno));
+
+    // rebuilt compiler gets fresh keys
+    unsigned long h = 0xcbf29ce484222325UL;
+    struct stat st;
+    if (!stat("/proc/self/exe", &st)) {
+        h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+        h = hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+    }
+    int flags[] = {CACHE_VERSION, opt_fold, opt_peephole, opt_ir_opt, opt_loop_opt,
+                   opt_tail_calls, opt_stack_reuse, opt_leaf_opt,
+                   opt_mem2reg, opt_inline, opt_inline_limit};
+    h = hash_bytes(h, flags, sizeof(flags));
+    cache_seed = hash_bytes(h, &profile_hash, sizeof(profile_hash));
+}
+
+// hash tokens of function starting at current token and find its end
+// (returns 0 if function is not well formed; parser reports it)
+unsigned long hash_function(int *end) {
+    int depth = 0;
+    bool obj = opt_obj || opt_run;
+    unsigned long h = hash_bytes(cache_seed, &obj, sizeof(obj));
+    for (int i = current_token; tokens[i].pattern != TK_EOF; i++) {
+        Token *tok = &tokens[i];
+        h = hash_bytes(h, &tok->pattern, 2);
+        h = hash_bytes(h, token_loc(tok), tok->len);
+        h = hash_bytes(h, &tok->len, sizeof(tok->len));
+        if (tok->pattern != TK_RESERVED)
+            continue;
+        if (tok->punct == PN_LBRACE)
+            depth++;
+        if (tok->punct == PN_RBRACE && --depth == 0) {
+            *end = i + 1;
+            return h ? h : 1;
+        }
+    }
+    return 0;
+}
+
+void cache_path(char *path, int size, unsigned long key) {
+    snprintf(path, size, "%s/%016lx", opt_cache_dir, key);
+}
+
+// read whole file (returns false if missing)
+bool read_file(char *path, Buffer *buf) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    buf_reserve(buf, st.st_size);
+    while (buf->len < st.st_size) {
+        int n = read(fd, buf->data + buf->len, st.st_size - buf->len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buf->len += n;
+    }
+    close(fd);
+    return buf->len == st.st_size;
+}
+
+// read cache entry (false on miss)
+bool cache_read(unsigned long key, Buffer *buf) {
+    char path[4096];
+    cache_path(path, sizeof(path), key);
+    bool ok = read_file(path, buf) && buf->len >= sizeof(CacheHeader);
+    CacheHeader *hdr = (CacheHeader *)buf->data;
+    if (!ok || hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION
+        || hdr->key != key || hdr->size != buf->len - sizeof(CacheHeader)) {
+        free(buf->data);
+        *buf = (Buffer){};
+        __atomic_fetch_add(&cache_misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // mark entry as recently used for eviction
+    utimensat(AT_FDCWD, path, NULL, 0);
+    __atomic_fetch_add(&cache_hits, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// find strongly connected components of calls (Tarjan); keys of
+// component take own hashes of its functions and keys of components
+// they call, so changed callee changes keys of callers it is inlined into
+void visit_scan_func(int v, unsigned long seed) {
+    ScanFunc *sf = &scan_funcs[v];
+    sf->index = sf->low = ++scan_index;
+    scan_stack[scan_depth++] = v;
+    sf->on_stack = true;
+
+    for (int i = 0; i < sf->ncallee; i++) {
+        ScanFunc *callee = &scan_funcs[sf->callees[i]];
+        if (!callee->index) {
+            visit_scan_func(sf->callees[i], seed);
+            if (callee->low < sf->low)
+                sf->low = callee->low;
+        } else if (callee->on_stack && callee->index < sf->low) {
+            sf->low = callee->index;
+        }
+    }
+
+    if (sf->low != sf->index)
+        return;
+    int first = scan_depth;
+    do
+        scan_funcs[scan_stack[--first]].on_stack = false;
+    while (scan_stack[first] != v);
+
+    // functions of earlier components already have keys
+    unsigned long h = seed;
+    for (int i = first; i < scan_depth; i++)
+        h = hash_bytes(h, &scan_funcs[scan_stack[i]].hash, sizeof(h));
+    for (int i = first; i < scan_depth; i++) {
+        ScanFunc *member = &scan_funcs[scan_stack[i]];
+        for (int j = 0; j < member->ncallee; j++)
+            if (scan_funcs[member->callees[j]].key)
+                h = hash_bytes(h, &scan_funcs[member->callees[j]].key, sizeof(h));
+    }
+    for (int i = first; i < scan_depth; i++) {
+        ScanFunc *member = &scan_funcs[scan_stack[i]];
+        unsigned long key = hash_bytes(h, &member->hash, sizeof(h));
+        member->key = key ? key : 1;
+    }
+    scan_depth = first;
+}
+
+// parse function and functions it calls (inlining takes their trees)
+void need_tree(int i) {
+    ScanFunc *sf = &scan_funcs[i];
+    if (sf->parse)
+        return;
+    sf->parse = true;
+    for (int j = 0; j < sf->ncallee; j++)
+        need_tree(sf->callees[j]);
+}
+
+// find functions of file, their calls and cache entries before parsing
+void cache_scan() {
+    int start = current_token;
+    int n = 0;
+    for (int end; tokens[current_token].pattern != TK_EOF; current_token = end, n++)
+        if (!hash_function(&end))
+            break;
+    scan_funcs = arena_alloc(&parse_arena, (n + 1) * sizeof(ScanFunc));
+    nscan_func = n;
+
+    // function of each name (first definition; duplicate is reported when linking)
+    int nid = 0;
+    for (int i = start; i < ntokens; i++)
+        if (tokens[i].pattern == TK_IDENT && tokens[i].val >= nid)
+            nid = tokens[i].val + 1;
+    int *fn_of_id = calloc(nid + 1, sizeof(int));
+    current_token = start;
+    for (int i = 0; i < n; i++) {
+        ScanFunc *sf = &scan_funcs[i];
+        sf->hash = hash_function(&sf->end);
+        if (!fn_of_id[tokens[current_token].val])
+            fn_of_id[tokens[current_token].val] = i + 1;
+        current_token = sf->end;
+    }
+
+    // calls are identifiers followed by "(" in body
+    current_token = start;
+    for (int i = 0; i < n && opt_inline; i++) {
+        ScanFunc *sf = &scan_funcs[i];
+        int body = current_token;
+        while (tokens[body].pattern != TK_RESERVED || tokens[body].punct != PN_LBRACE)
+            body++;
+        for (int pass = 0; pass < 2; pass++) {
+            sf->ncallee = 0;
+            for (int j = body; j < sf->end; j++) {
+                Token *tok = &tokens[j];
+                if (tok->pattern != TK_IDENT || tok[1].pattern != TK_RESERVED
+                    || tok[1].punct != PN_LPAREN || !fn_of_id[tok->val])
+                    continue;
+                if (pass)
+                    sf->callees[sf->ncallee] = fn_of_id[tok->val] - 1;
+                sf->ncallee++;
+            }
+            if (!pass)
+                sf->callees = arena_alloc(&parse_arena, (sf->ncallee + 1) * sizeof(int));
+        }
+        current_token = sf->end;
+    }
+    free(fn_of_id);
+    current_token = start;
+
+    // hot call sites are ranked over whole program with profile
+    unsigned long seed = 0xcbf29ce484222325UL;
+    if (opt_profile_use)
+        for (int i = 0; i < n; i++)
+            seed = hash_bytes(seed, &scan_funcs[i].hash, sizeof(seed));
+    scan_stack = calloc(n + 1, sizeof(int));
+    scan_depth = scan_index = 0;
+    for (int i = 0; i < n; i++)
+        if (!scan_funcs[i].index)
+            visit_scan_func(i, seed);
+    free(scan_stack);
+
+    for (int i = 0; i < n; i++)
+        cache_read(scan_funcs[i].key, &scan_funcs[i].cached);
+    for (int i = 0; i < n; i++)
+        if (!scan_funcs[i].cached.data)
+            need_tree(i);
+}
+
+// take function at current token (i-th of file) from cache, parsing it
+// unless it was found and no parsed function calls it
+Function *cache_function(int i) {
+    if (i >= nscan_func)
+        return function(); // not well formed; parser reports it
+    ScanFunc *sf = &scan_funcs[i];
+    Function *fn;
+    if (sf->parse) {
+        fn = function();
+    } else {
+        fn = arena_alloc(&parse_arena, sizeof(Function));
+        fn->name = intern_name(tokens[current_token].val);
+        current_token = sf->end;
+    }
+    fn->cache_key = sf->key;
+    fn->cached = sf->cached;
+    return fn;
+}
+
+void put_int(Buffer *buf, int val) {
+    buf_write(buf, (char *)&val, sizeof(val));
+}
+
+int get_int(char **p) {
+    int val;
+    memcpy(&val, *p, sizeof(val));
+    *p += sizeof(val);
+    return val;
+}
+
+// payload of object piece: text, symbols and relocations
+void serialize_object(Object *obj, Buffer *buf) {
+    put_int(buf, obj->text.len);
+    buf_write(buf, obj->text.data, obj->text.len);
+    put_int(buf, obj->nsym);
+    for (int i = 0; i < obj->nsym; i++) {
+        ObjSym *sym = &obj->syms[i];
+        buf_write(buf, sym->name, strlen(sym->name) + 1);
+        put_int(buf, sym->offset);
+        put_int(buf, sym->size);
+        put_int(buf, sym->defined);
+    }
+    put_int(buf, obj->nreloc);
+    for (int i = 0; i < obj->nreloc; i++) {
+        put_int(buf, obj->relocs[i].offset);
+        put_int(buf, obj->relocs[i].sym);
+        put_int(buf, obj->relocs[i].addend);
+        put_int(buf, obj->relocs[i].data);
+    }
+}
+
+// rebuild object piece (symbol names point into cached bytes)
+void deserialize_object(char *p, Object *obj) {
+    int len = get_int(&p);
+    buf_write(&obj->text, p, len);
+    p += len;
+    obj->nsym = get_int(&p);
+    obj->syms = calloc(obj->nsym + 1, sizeof(ObjSym));
+    for (int i = 0; i < obj->nsym; i++) {
+        ObjSym *sym = &obj->syms[i];
+        sym->name = p;
+        p += strlen(p) + 1;
+        sym->offset = get_int(&p);
+        sym->size = get_int(&p);
+        sym->defined = get_int(&p);
+    }
+    obj->nreloc = get_int(&p);
+    obj->relocs = calloc(obj->nreloc + 1, sizeof(ObjReloc));
+    for (int i = 0; i < obj->nreloc; i++) {
+        obj->relocs[i].offset = get_int(&p);
+        obj->relocs[i].sym = get_int(&p);
+        obj->relocs[i].addend = get_int(&p);
+        obj->relocs[i].data = get_int(&p);
+    }
+}
+
+// output of cached function
+void cache_output(Function *fn, Buffer *out, Object *obj) {
+    char *payload = fn->cached.data + sizeof(CacheHeader);
+    if (opt_obj || opt_run)
+        deserialize_object(payload, obj);
+    else
+        buf_write(out, payload, fn->cached.len - sizeof(CacheHeader));
+}
+
+// save generated output of function (called from code generation threads)
+void cache_store(Function *fn, Buffer *out, Object *obj) {
+    Buffer buf = {};
+    CacheHeader hdr = {CACHE_MAGIC, CACHE_VERSION, fn->cache_key};
+    buf_write(&buf, (char *)&hdr, sizeof(hdr));
+    if (opt_obj || opt_run)
+        serialize_object(obj, &buf);
+    else
+        buf_write(&buf, out->data, out->len);
+    ((CacheHeader *)buf.data)->size = buf.len - sizeof(hdr);
+
+    // write to temporary file and rename so readers never see partial entry
+    char path[4096], tmp[sizeof(path) + 32];
+    cache_path(path, sizeof(path), fn->cache_key);
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, getpid(), (unsigned long)pthread_self());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        bool ok = write(fd, buf.data, buf.len) == buf.len;
+        close(fd);
+        if (ok && !rename(tmp, path))
+            __atomic_fetch_add(&cache_stores, 1, __ATOMIC_RELAXED);
+        else
+            unlink(tmp);
+    }
+    free(buf.data);
+}
+
+int cmp_used(const void *a, const void *b) {
+    const CacheFile *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec)
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    if (x->used.tv_nsec != y->used.tv_nsec)
+        return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// remove least recently used entries until cache fits its size cap
+void cache_evict() {
+    DIR *dir = opendir(opt_cache_dir);
+    if (!dir)
+        return;
+    int fd = dirfd(dir);
+
+    int n = 0, cap = 64;
+    CacheFile *files = calloc(cap, sizeof(CacheFile));
+    long total = 0;
+    for (struct dirent *de; (de = readdir(dir)); ) {
+        struct stat st;
+        if (de->d_name[0] == '.' || fstatat(fd, de->d_name, &st, 0) || !S_ISREG(st.st_mode))
+            continue;
+        if (n == cap)
+            files = realloc(files, (cap *= 2) * sizeof(CacheFile));
+        files[n++] = (CacheFile){strdup(de->d_name), st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+
+    if (total > opt_cache_size) {
+        qsort(files, n, sizeof(CacheFile), cmp_used);
+        for (int i = 0; i < n && total > opt_cache_size; i++) {
+            if (unlinkat(fd, files[i].name, 0))
+                continue;
+            total -= files[i].size;
+            __atomic_fetch_add(&cache_evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        free(files[i].name);
+    free(files);
+    closedir(dir);
+}
+
+void cache_report() {
+    fprintf(stderr, "cache: %d hits, %d misses, %d stored, %d evicted\n",
+            cache_hits, cache_misses, cache_stores, cache_evictions);
+}
@@ -0,0 +1,177 @@
+#include "9cc.h"
+#include <elf.h>
+
+// section numbers of object file
+enum {
+    SEC_NULL,
+    SEC_TEXT,
+    SEC_RELA,
+    SEC_RODATA,
+    SEC_BSS,
+    SEC_INIT_ARRAY,
+    SEC_RELA_INIT_ARRAY,
+    SEC_SYMTAB,
+    SEC_STRTAB,
+    SEC_NOTE,
+    SEC_SHSTRTAB,
+    NSEC,
+};
+
+// pad buffer with zeros to multiple of align
+void buf_align(Buffer *buf, int align) {
+    while (buf->len % align)
+        buf_char(buf, 0);
+}
+
+// symbol not visible outside object (as ".L" labels of assembler)
+bool is_local_sym(char *name) {
+    return !strncmp(name, ".L", 2);
+}
+
+// write section and fill its header
+void put_section(Buffer *buf, Elf64_Shdr *sh, void *data, int len, int align) {
+    buf_align(buf, align);
+    sh->sh_offset = buf->len;
+    sh->sh_size = len;
+    sh->sh_addralign = align;
+    buf_write(buf, data, len);
+}
+
+// write object as ELF64 relocatable file
+void write_elf(Object *obj, Buffer *buf) {
+    Elf64_Ehdr eh = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT},
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = NSEC,
+        .e_shstrndx = SEC_SHSTRTAB,
+    };
+    Elf64_Shdr sh[NSEC] = {};
+    buf_write(buf, (char *)&eh, sizeof(eh));
+
+    // names of sections
+    Buffer shstr = {};
+    char *sec_name[] = {
+        [SEC_NULL] = "", [SEC_TEXT] = ".text", [SEC_RELA] = ".rela.text",
+        [SEC_RODATA] = ".rodata", [SEC_BSS] = ".bss", [SEC_INIT_ARRAY] = ".init_array",
+        [SEC_RELA_INIT_ARRAY] = ".rela.init_array", [SEC_SYMTAB] = ".symtab", [SEC_STRTAB] = ".strtab",
+        [SEC_NOTE] = ".note.GNU-stack", [SEC_SHSTRTAB] = ".shstrtab",
+    };
+    for (int i = 0; i < NSEC; i++) {
+        sh[i].sh_name = shstr.len;
+        buf_write(&shstr, sec_name[i], strlen(sec_name[i]) + 1);
+    }
+
+    // local symbols come first after null symbol
+    int *index = calloc(obj->nsym + 1, sizeof(int));
+    int nlocal = 1;
+    for (int i = 0; i < obj->nsym; i++)
+        nlocal += is_local_sym(obj->syms[i].name);
+    int next_local = 1, next_global = nlocal;
+    for (int i = 0; i < obj->nsym; i++)
+        index[i] = is_local_sym(obj->syms[i].name) ? next_local++ : next_global++;
+
+    int sec_of[] = {[SC_TEXT] = SEC_TEXT, [SC_RODATA] = SEC_RODATA, [SC_BSS] = SEC_BSS};
+    Buffer str = {};
+    buf_char(&str, 0);
+    Elf64_Sym *syms = calloc(obj->nsym + 1, sizeof(Elf64_Sym));
+    for (int i = 0; i < obj->nsym; i++) {
+        ObjSym *sym = &obj->syms[i];
+        Elf64_Sym *es = &syms[index[i]];
+        int bind = is_local_sym(sym->name) ? STB_LOCAL : STB_GLOBAL;
+        es->st_name = str.len;
+        buf_write(&str, sym->name, strlen(sym->name) + 1);
+        if (sym->defined) {
+            es->st_info = ELF64_ST_INFO(bind, sym->section == SC_TEXT ? STT_FUNC : STT_OBJECT);
+            es->st_shndx = sec_of[sym->section];
+            es->st_value = sym->offset;
+            es->st_size = sym->size;
+        } else {
+            es->st_info = ELF64_ST_INFO(bind, STT_NOTYPE);
+            es->st_shndx = SHN_UNDEF;
+        }
+    }
+
+    Elf64_Rela *rela = calloc(obj->nreloc + 1, sizeof(Elf64_Rela));
+    for (int i = 0; i < obj->nreloc; i++) {
+        ObjReloc *rel = &obj->relocs[i];
+        rela[i].r_offset = rel->offset;
+        rela[i].r_info = ELF64_R_INFO(index[rel->sym], rel->data ? R_X86_64_PC32 : R_X86_64_PLT32);
+        rela[i].r_addend = rel->addend;
+    }
+
+    // constructor is listed by absolute address
+    unsigned long init_array = 0;
+    Elf64_Rela init_rela = {};
+    int ninit = 0;
+    for (int i = 0; obj->init_fn && i < obj->nsym; i++) {
+        if (obj->syms[i].defined && !strcmp(obj->syms[i].name, obj->init_fn)) {
+            init_rela.r_info = ELF64_R_INFO(index[i], R_X86_64_64);
+            ninit = 1;
+        }
+    }
+
+    sh[SEC_TEXT].sh_type = SHT_PROGBITS;
+    sh[SEC_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+    put_section(buf, &sh[SEC_TEXT], obj->text.data, obj->text.len, 16);
+
+    sh[SEC_RELA].sh_type = SHT_RELA;
+    sh[SEC_RELA].sh_flags = SHF_INFO_LINK;
+    sh[SEC_RELA].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA].sh_info = SEC_TEXT;
+    sh[SEC_RELA].sh_entsize = sizeof(Elf64_Rela);
+    put_section(buf, &sh[SEC_RELA], rela, obj->nreloc * sizeof(Elf64_Rela), 8);
+
+    sh[SEC_RODATA].sh_type = SHT_PROGBITS;
+    sh[SEC_RODATA].sh_flags = SHF_ALLOC;
+    put_section(buf, &sh[SEC_RODATA], obj->rodata.data, obj->rodata.len, 8);
+
+    // .bss takes no space in file
+    sh[SEC_BSS].sh_type = SHT_NOBITS;
+    sh[SEC_BSS].sh_flags = SHF_ALLOC | SHF_WRITE;
+    sh[SEC_BSS].sh_offset = buf->len;
+    sh[SEC_BSS].sh_size = obj->bss_size;
+    sh[SEC_BSS].sh_addralign = 8;
+
+    sh[SEC_INIT_ARRAY].sh_type = SHT_INIT_ARRAY;
+    sh[SEC_INIT_ARRAY].sh_flags = SHF_ALLOC | SHF_WRITE;
+    sh[SEC_INIT_ARRAY].sh_entsize = sizeof(init_array);
+    put_section(buf, &sh[SEC_INIT_ARRAY], &init_array, ninit * sizeof(init_array), 8);
+
+    sh[SEC_RELA_INIT_ARRAY].sh_type = SHT_RELA;
+    sh[SEC_RELA_INIT_ARRAY].sh_flags = SHF_INFO_LINK;
+    sh[SEC_RELA_INIT_ARRAY].sh_link = SEC_SYMTAB;
+    sh[SEC_RELA_INIT_ARRAY].sh_info = SEC_INIT_ARRAY;
+    sh[SEC_RELA_INIT_ARRAY].sh_entsize = sizeof(Elf64_Rela);
+    put_section(buf, &sh[SEC_RELA_INIT_ARRAY], &init_rela, ninit * sizeof(Elf64_Rela), 8);
+
+    sh[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+    sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    sh[SEC_SYMTAB].sh_info = nlocal; // first global symbol
+    sh[SEC_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+    put_section(buf, &sh[SEC_SYMTAB], syms, (obj->nsym + 1) * sizeof(Elf64_Sym), 8);
+
+    sh[SEC_STRTAB].sh_type = SHT_STRTAB;
+    put_section(buf, &sh[SEC_STRTAB], str.data, str.len, 1);
+
+    // mark stack as not executable
+    sh[SEC_NOTE].sh_type = SHT_PROGBITS;
+    put_section(buf, &sh[SEC_NOTE], NULL, 0, 1);
+
+    sh[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+    put_section(buf, &sh[SEC_SHSTRTAB], shstr.data, shstr.len, 1);
+
+    buf_align(buf, 8);
+    eh.e_shoff = buf->len;
+    memcpy(buf->data, &eh, sizeof(eh));
+    buf_write(buf, (char *)sh, sizeof(sh));
+
+    free(index);
+    free(syms);
+    free(rela);
+    free(str.data);
+    free(shstr.data);
+}
@@ -0,0 +1,363 @@
+#include "9cc.h"
+
+#define REX 0x40 // Force REX prefix (to reach spl, bpl, sil and dil)
+#define REX_W 0x48 // 64 bit operand size
+
+// condition field of jcc and setcc
+int cc_code[] = {
+    [CC_E] = 0x4, [CC_NE] = 0x5, [CC_L] = 0xc,
+    [CC_LE] = 0xe, [CC_G] = 0xf, [CC_GE] = 0xd,
+};
+
+// rel32 field to patch once its target is known
+typedef struct Fixup Fixup;
+struct Fixup {
+    int offset; // Offset of rel32 field
+    int target; // Label number
+};
+
+// state of encoder (functions are encoded concurrently)
+_Thread_local Object *object;
+_Thread_local Buffer *text;
+_Thread_local int *label_offset;
+_Thread_local Fixup *jumps;
+_Thread_local int njump;
+_Thread_local ObjReloc *rip_reloc; // RIP-relative operand of current instruction
+_Thread_local int *sym_slots; // Open addressing table of symbol index + 1
+_Thread_local int sym_cap;
+
+void put_byte(int b) {
+    buf_char(text, b);
+}
+
+void put_u32(unsigned val) {
+    for (int i = 0; i < 4; i++)
+        put_byte(val >> (i * 8));
+}
+
+void put_u64(unsigned long val) {
+    put_u32(val);
+    put_u32(val >> 32);
+}
+
+void patch_u32(int offset, unsigned val) {
+    for (int i = 0; i < 4; i++)
+        text->data[offset + i] = val >> (i * 8);
+}
+
+bool is_imm8(long val) {
+    return -128 <= val && val < 128;
+}
+
+bool is_imm32(long val) {
+    return -2147483648L <= val && val <= 2147483647L;
+}
+
+int find_sym(Object *obj, char *name);
+
+// write ModR/M byte (with SIB and displacement) for register and r/m operand
+void put_modrm(int reg, Operand rm) {
+    reg &= 7;
+    if (rm.pattern == OP_REG) {
+        put_byte(0xc0 | reg << 3 | (rm.reg & 7));
+        return;
+    }
+
+    // displacement from end of instruction is known once it is complete
+    if (rm.pattern == OP_SYM) {
+        put_byte(reg << 3 | 5);
+        rip_reloc = &object->relocs[object->nreloc++];
+        *rip_reloc = (ObjReloc){text->len, find_sym(object, rm.sym), rm.val, true};
+        put_u32(0);
+        return;
+    }
+
+    // [rbp] and [r13] have no form without displacement
+    int base = rm.reg & 7;
+    int mod = rm.val == 0 && base != RBP ? 0 : is_imm8(rm.val) ? 1 : 2;
+    put_byte(mod << 6 | reg << 3 | base);
+    if (base == RSP)
+        put_byte(0x24);
+    if (mod == 1)
+        put_byte(rm.val);
+    else if (mod == 2)
+        put_u32(rm.val);
+}
+
+// write "opcode reg, r/m" (opcode above 0xff is two bytes) with REX if needed
+void put_rm(int rex, int opcode, int reg, Operand rm) {
+    rex |= (reg >> 3) << 2 | (rm.reg >> 3);
+    if (rex)
+        put_byte(REX | rex);
+    if (opcode > 0xff)
+        put_byte(opcode >> 8);
+    put_byte(opcode & 0xff);
+    put_modrm(reg, rm);
+}
+
+// add, sub, cmp and mov share forms "op r/m, r", "op r, r/m" and "op r/m, imm"
+void put_arith(int op_mr, int op_rm, int ext, Operand dst, Operand src) {
+    if (src.pattern == OP_IMM) {
+        if (!is_imm32(src.val))
+            error("immediate out of range: %ld", src.val);
+        if (ext >= 0 && is_imm8(src.val)) {
+            put_rm(REX_W, 0x83, ext, dst);
+            put_byte(src.val);
+            return;
+        }
+        put_rm(REX_W, ext >= 0 ? 0x81 : 0xc7, ext >= 0 ? ext : 0, dst);
+        put_u32(src.val);
+        return;
+    }
+    if (src.pattern == OP_REG) {
+        put_rm(REX_W, op_mr, src.reg, dst);
+        return;
+    }
+    put_rm(REX_W, op_rm, dst.reg, src);
+}
+
+// write rel32 jump to label
+void put_jump(int opcode, int label) {
+    if (opcode > 0xff)
+        put_byte(opcode >> 8);
+    put_byte(opcode & 0xff);
+    jumps[njump++] = (Fixup){text->len, label};
+    put_u32(0);
+}
+
+// find or add symbol by name
+int find_sym(Object *obj, char *name) {
+    unsigned i = hash_string(name, strlen(name)) & (sym_cap - 1);
+    for (; sym_slots[i]; i = (i + 1) & (sym_cap - 1))
+        if (!strcmp(obj->syms[sym_slots[i] - 1].name, name))
+            return sym_slots[i] - 1;
+
+    obj->syms[obj->nsym].name = name;
+    sym_slots[i] = ++obj->nsym;
+    return obj->nsym - 1;
+}
+
+// write call (0xe8) or jmp (0xe9) to symbol resolved when linking
+void put_call(Object *obj, int opcode, char *sym) {
+    put_byte(opcode);
+    obj->relocs[obj->nreloc++] = (ObjReloc){text->len, find_sym(obj, sym), -4};
+    put_u32(0);
+}
+
+void encode_inst(Object *obj, Inst *in) {
+    Operand dst = in->dst;
+    Operand src = in->src;
+
+    switch (in->pattern) {
+    case IN_MOV:
+        if (src.pattern == OP_IMM && dst.pattern == OP_REG && !is_imm32(src.val)) {
+            put_byte(REX_W | dst.reg >> 3);
+            put_byte(0xb8 + (dst.reg & 7));
+            put_u64(src.val);
+            return;
+        }
+        put_arith(0x89, 0x8b, -1, dst, src);
+        return;
+    case IN_LEA:
+        put_rm(REX_W, 0x8d, dst.reg, src);
+        return;
+    case IN_ADD:
+        put_arith(0x01, 0x03, 0, dst, src);
+        return;
+    case IN_SUB:
+        put_arith(0x29, 0x2b, 5, dst, src);
+        return;
+    case IN_CMP:
+        put_arith(0x39, 0x3b, 7, dst, src);
+        return;
+    case IN_IMUL:
+        if (src.pattern == OP_IMM) {
+            put_rm(REX_W, is_imm8(src.val) ? 0x6b : 0x69, dst.reg, dst);
+            if (is_imm8(src.val))
+                put_byte(src.val);
+            else
+                put_u32(src.val);
+            return;
+        }
+        put_rm(REX_W, 0x0faf, dst.reg, src);
+        return;
+    case IN_CQO:
+        put_byte(REX_W);
+        put_byte(0x99);
+        return;
+    case IN_IDIV:
+        put_rm(REX_W, 0xf7, 7, src);
+        return;
+    case IN_IMULH:
+        put_rm(REX_W, 0xf7, 5, src);
+        return;
+    case IN_SHL:
+    case IN_SAR:
+    case IN_SHR:
+        put_rm(REX_W, 0xc1, in->pattern == IN_SHL ? 4 : in->pattern == IN_SAR ? 7 : 5, dst);
+        put_byte(src.val);
+        return;
+    case IN_NEG:
+        put_rm(REX_W, 0xf7, 3, dst);
+        return;
+    case IN_SETCC:
+        put_rm(dst.pattern == OP_REG && RSP <= dst.reg && dst.reg <= RDI ? REX : 0,
+               0x0f90 | cc_code[in->cc], 0, dst);
+        return;
+    case IN_MOVZB:
+        put_rm(REX_W, 0x0fb6, dst.reg, src);
+        return;
+    case IN_PUSH:
+        if (src.pattern == OP_IMM) {
+            put_byte(0x68);
+            put_u32(src.val);
+        } else if (src.pattern == OP_REG) {
+            if (src.reg >= R8)
+                put_byte(REX | 1);
+            put_byte(0x50 + (src.reg & 7));
+        } else {
+            put_rm(0, 0xff, 6, src);
+        }
+        return;
+    case IN_POP:
+        if (dst.pattern == OP_REG) {
+            if (dst.reg >= R8)
+                put_byte(REX | 1);
+            put_byte(0x58 + (dst.reg & 7));
+        } else {
+            put_rm(0, 0x8f, 0, dst);
+        }
+        return;
+    case IN_JMP:
+        put_jump(0xe9, in->label);
+        return;
+    case IN_JCC:
+        put_jump(0x0f80 | cc_code[in->cc], in->label);
+        return;
+    case IN_CALL:
+        put_rm(REX_W, 0x31, RAX, reg_operand(RAX)); // xor rax, rax
+        put_call(obj, 0xe8, in->sym);
+        return;
+    case IN_TAILCALL:
+        put_rm(REX_W, 0x31, RAX, reg_operand(RAX)); // xor rax, rax
+        put_call(obj, 0xe9, in->sym);
+        return;
+    case IN_LABEL:
+        label_offset[in->label] = text->len;
+        return;
+    case IN_RET:
+        put_byte(0xc3);
+        return;
+    case IN_GLOBAL:
+        // every function is global
+        return;
+    case IN_SYMBOL: {
+        ObjSym *sym = &obj->syms[find_sym(obj, in->sym)];
+        sym->defined = true;
+        sym->offset = text->len;
+        return;
+    }
+    }
+    error("cannot encode instruction");
+}
+
+// size symbol table for n symbols
+void init_syms(Object *obj, int n) {
+    for (sym_cap = 16; sym_cap < n * 2; sym_cap *= 2)
+        ;
+    sym_slots = calloc(sym_cap, sizeof(int));
+    obj->syms = calloc(n + 1, sizeof(ObjSym));
+}
+
+// encode instructions of function to machine code resolving its labels
+void encode_function(Inst *insts, Object *obj) {
+    int n = 0, nlabel = max_label(insts) + 1;
+    for (Inst *in = insts; in; in = in->next)
+        n++;
+
+    object = obj;
+    text = &obj->text;
+    label_offset = calloc(nlabel, sizeof(int));
+    jumps = calloc(n + 1, sizeof(Fixup));
+    njump = 0;
+    init_syms(obj, n);
+    obj->relocs = calloc(n + 1, sizeof(ObjReloc));
+
+    // calls and symbol addresses are resolved when functions are linked
+    ObjSym *fn = NULL;
+    for (Inst *in = insts; in; in = in->next) {
+        int start = text->len;
+        encode_inst(obj, in);
+        if (in->pattern == IN_SYMBOL) {
+            if (fn)
+                fn->size = start - fn->offset;
+            fn = &obj->syms[find_sym(obj, in->sym)];
+        }
+        if (rip_reloc) {
+            rip_reloc->addend -= text->len - rip_reloc->offset;
+            rip_reloc = NULL;
+        }
+    }
+    if (fn)
+        fn->size = text->len - fn->offset;
+
+    for (int i = 0; i < njump; i++)
+        patch_u32(jumps[i].offset, label_offset[jumps[i].target] - (jumps[i].offset + 4));
+
+    free(label_offset);
+    free(jumps);
+    free(sym_slots);
+}
+
+// concatenate functions in order, resolving calls between them
+void link_objects(Object *parts, int nparts, Object *obj) {
+    int nsym = 0, nreloc = 0;
+    for (int i = 0; i < nparts; i++) {
+        nsym += parts[i].nsym;
+        nreloc += parts[i].nreloc;
+    }
+    text = &obj->text;
+    init_syms(obj, nsym);
+    obj->relocs = calloc(nreloc + 1, sizeof(ObjReloc));
+
+    int *base = calloc(nparts + 1, sizeof(int));
+    for (int i = 0; i < nparts; i++) {
+        base[i] = text->len;
+        buf_write(text, parts[i].text.data, parts[i].text.len);
+        for (int j = 0; j < parts[i].nsym; j++) {
+            ObjSym *part_sym = &parts[i].syms[j];
+            if (!part_sym->defined)
+                continue;
+            ObjSym *sym = &obj->syms[find_sym(obj, part_sym->name)];
+            if (sym->defined)
+                error("duplicate function: %s", sym->name);
+            *sym = *part_sym;
+            sym->offset += base[i];
+        }
+    }
+
+    // references to functions of this object need no relocation
+    for (int i = 0; i < nparts; i++) {
+        for (int j = 0; j < parts[i].nreloc; j++) {
+            ObjReloc *rel = &parts[i].relocs[j];
+            int offset = base[i] + rel->offset;
+            int s = find_sym(obj, parts[i].syms[rel->sym].name);
+            if (obj->syms[s].defined)
+                patch_u32(offset, obj->syms[s].offset + rel->addend - offset);
+            else
+                obj->relocs[obj->nreloc++] = (ObjReloc){offset, s, rel->addend, rel->data};
+        }
+    }
+
+    free(base);
+    free(sym_slots);
+}
+
+// define data symbol referred to by linked functions
+void define_symbol(Object *obj, char *name, Section section, int offset, int size) {
+    for (int i = 0; i < obj->nsym; i++) {
+        ObjSym *sym = &obj->syms[i];
+        if (!sym->defined && !strcmp(sym->name, name))
+            *sym = (ObjSym){name, offset, size, true, section};
+    }
+}
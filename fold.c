@@ -0,0 +1,185 @@
+#include "9cc.h"
+
+Node *fold(Node *node);
+
+bool is_num(Node *node, int val) {
+    return node->pattern == ND_NUM && node->val == val;
+}
+
+// check whether evaluating node may change state
+bool has_side_effect(Node *node) {
+    if (!node)
+        return false;
+    switch (node->pattern) {
+    case ND_ASSIGN:
+    case ND_FUNCALL:
+    case ND_INLINE:
+        return true;
+    }
+    return has_side_effect(node->lhs) || has_side_effect(node->rhs);
+}
+
+// evaluate binary operator on constants (false if not foldable)
+bool eval_binary(NodePattern pattern, long lhs, long rhs, long *val) {
+    switch (pattern) {
+    case ND_ADD:
+        *val = lhs + rhs;
+        break;
+    case ND_SUB:
+        *val = lhs - rhs;
+        break;
+    case ND_MUL:
+        *val = lhs * rhs;
+        break;
+    case ND_DIV:
+        if (rhs == 0)
+            return false;
+        *val = lhs / rhs;
+        break;
+    case ND_EQ:
+        *val = lhs == rhs;
+        break;
+    case ND_NE:
+        *val = lhs != rhs;
+        break;
+    case ND_LT:
+        *val = lhs < rhs;
+        break;
+    case ND_LE:
+        *val = lhs <= rhs;
+        break;
+    default:
+        return false;
+    }
+    return *val == (int)*val;
+}
+
+// apply algebraic identities to binary node with folded operands
+Node *simplify(Node *node) {
+    Node *lhs = node->lhs;
+    Node *rhs = node->rhs;
+
+    switch (node->pattern) {
+    case ND_ADD:
+        if (is_num(rhs, 0))
+            return lhs;
+        if (is_num(lhs, 0))
+            return rhs;
+        break;
+    case ND_SUB:
+        if (is_num(rhs, 0))
+            return lhs;
+        if (is_num(lhs, 0))
+            return fold(new_binary(ND_NEG, rhs, NULL));
+        break;
+    case ND_MUL:
+        if (is_num(rhs, 1))
+            return lhs;
+        if (is_num(lhs, 1))
+            return rhs;
+        if ((is_num(rhs, 0) && !has_side_effect(lhs))
+            || (is_num(lhs, 0) && !has_side_effect(rhs)))
+            return new_val_node(0);
+        break;
+    case ND_DIV:
+        if (is_num(rhs, 1))
+            return lhs;
+        break;
+    }
+    return node;
+}
+
+// fold statement list
+Node *fold_list(Node *node) {
+    Node head;
+    head.next = NULL;
+    Node *cur = &head;
+
+    for (Node *n = node; n; ) {
+        Node *next = n->next;
+        cur->next = fold(n);
+        cur = cur->next;
+        cur->next = NULL;
+        n = next;
+    }
+    return head.next;
+}
+
+// empty statement
+Node *empty_block() {
+    return new_node(ND_BLOCK);
+}
+
+// fold constant subtrees of node and return replacement
+Node *fold(Node *node) {
+    if (!node)
+        return NULL;
+
+    switch (node->pattern) {
+    case ND_NUM:
+    case ND_VAR:
+        return node;
+    case ND_NEG: {
+        node->lhs = fold(node->lhs);
+        long val;
+        if (node->lhs->pattern == ND_NUM && eval_binary(ND_SUB, 0, node->lhs->val, &val))
+            return new_val_node(val);
+        if (node->lhs->pattern == ND_NEG)
+            return node->lhs->lhs;
+        return node;
+    }
+    case ND_IF:
+        node->cond = fold(node->cond);
+        node->then = fold(node->then);
+        node->els = fold(node->els);
+        if (node->cond->pattern == ND_NUM) {
+            if (node->cond->val)
+                return node->then;
+            return node->els ? node->els : empty_block();
+        }
+        return node;
+    case ND_WHILE:
+        node->cond = fold(node->cond);
+        node->then = fold(node->then);
+        if (node->cond && node->cond->pattern == ND_NUM) {
+            if (!node->cond->val)
+                return empty_block();
+            node->cond = NULL;
+        }
+        return node;
+    case ND_FOR:
+        node->init = fold(node->init);
+        node->cond = fold(node->cond);
+        node->inc = fold(node->inc);
+        node->then = fold(node->then);
+        if (node->cond && node->cond->pattern == ND_NUM) {
+            if (!node->cond->val)
+                return node->init ? node->init : empty_block();
+            node->cond = NULL;
+        }
+        return node;
+    case ND_BLOCK:
+        node->stmts = fold_list(node->stmts);
+        return node;
+    case ND_FUNCALL:
+        node->args = fold_list(node->args);
+        return node;
+    }
+
+    node->lhs = fold(node->lhs);
+    node->rhs = fold(node->rhs);
+
+    long val;
+    if (node->lhs && node->lhs->pattern == ND_NUM
+        && node->rhs && node->rhs->pattern == ND_NUM
+        && eval_binary(node->pattern, node->lhs->val, node->rhs->val, &val))
+        return new_val_node(val);
+
+    return simplify(node);
+}
+
+// fold constants in every function
+void fold_program(Function *program) {
+    for (Function *fn = program; fn; fn = fn->next)
+        fn->node = fold_list(fn->node);
+}
@@ -0,0 +1,247 @@
+#include "9cc.h"
+
+// live range of variable over instruction positions
+typedef struct VarRange VarRange;
+struct VarRange {
+    Var *var;
+    int start; // First live position (-1 if never accessed)
+    int end; // Last live position
+    long weight; // Number of loads and stores
+    int slot; // Shared slot
+};
+
+// variable whose address is taken by instruction (NULL if none)
+Var *lvar_of(IR **def, int value) {
+    IR *ir = def[value];
+    return ir && ir->pattern == IR_LVAR ? ir->var : NULL;
+}
+
+// check whether address of some variable is used other than to load or
+// store the variable itself
+bool address_escapes(IRFunc *fn, IR **def) {
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->ir; ir; ir = ir->next) {
+            int *opd[6];
+            int nopd = ir_operands(ir, opd);
+            for (int i = 0; i < nopd; i++) {
+                if (!lvar_of(def, *opd[i]))
+                    continue;
+                if ((ir->pattern != IR_LOAD && ir->pattern != IR_STORE) || opd[i] != &ir->a)
+                    return true;
+            }
+        }
+    }
+    return false;
+}
+
+// check whether function makes no calls and no address of variable escapes
+bool is_leaf(IRFunc *fn) {
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+            if (ir->pattern == IR_CALL || ir->pattern == IR_TAILCALL)
+                return false;
+    return !address_escapes(fn, value_defs(fn));
+}
+
+void extend_range(VarRange *r, int pos) {
+    if (r->start < 0 || pos < r->start)
+        r->start = pos;
+    if (pos > r->end)
+        r->end = pos;
+}
+
+int cmp_range_start(const void *a, const void *b) {
+    const VarRange *x = *(VarRange **)a, *y = *(VarRange **)b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return x->var->index - y->var->index;
+}
+
+// accesses of each slot (for cmp_slot_weight)
+_Thread_local long *slot_weight;
+
+int cmp_slot_weight(const void *a, const void *b) {
+    int x = *(int *)a, y = *(int *)b;
+    if (slot_weight[x] != slot_weight[y])
+        return slot_weight[x] > slot_weight[y] ? -1 : 1;
+    return x - y;
+}
+
+// give variables kept in memory with disjoint live ranges same stack slot, frequently
+// accessed slots nearest to RBP (every variable keeps its own slot if an
+// address escapes, since code may step from one variable to next)
+void share_slots(Function *fn, IRFunc *ir) {
+    IR **def = value_defs(ir);
+    if (address_escapes(ir, def)) {
+        allocate_memory(fn);
+        return;
+    }
+
+    // only variables kept in memory take part
+    int nvar = 0;
+    for (VarList *vl = fn->var_list; vl; vl = vl->next)
+        if (!vl->var->vreg)
+            vl->var->index = nvar++;
+    fn->stack_size = 0;
+    if (!nvar)
+        return;
+    VarRange *range = calloc(nvar + 1, sizeof(VarRange));
+    for (VarList *vl = fn->var_list; vl; vl = vl->next)
+        if (!vl->var->vreg)
+            range[vl->var->index] = (VarRange){vl->var, -1, -1};
+
+    // parameters are stored by prologue at position 0
+    int nblock = ir->nblock;
+    int *home = calloc(nvar + 1, sizeof(int));
+    int *gid = calloc(nvar + 1, sizeof(int));
+    for (VarList *vl = fn->params; vl; vl = vl->next) {
+        if (vl->var->vreg)
+            continue;
+        home[vl->var->index] = ir->blocks->id + 1;
+        extend_range(&range[vl->var->index], 0);
+    }
+
+    // variables accessed in one block only and stored there first are never
+    // live across blocks, so only the others take part in dataflow
+    int *first = calloc(nblock + 1, sizeof(int));
+    int *last = calloc(nblock + 1, sizeof(int));
+    int pos = 0;
+    for (BasicBlock *bb = ir->blocks; bb; bb = bb->next) {
+        first[bb->id] = pos + 1;
+        for (IR *in = bb->ir; in; in = in->next) {
+            pos++;
+            Var *var = NULL;
+            if (in->pattern == IR_LOAD || in->pattern == IR_STORE)
+                var = lvar_of(def, in->a);
+            if (!var || var->vreg)
+                continue;
+            int v = var->index;
+            range[v].weight++;
+            extend_range(&range[v], pos);
+            if (home[v] != bb->id + 1 && (home[v] || in->pattern == IR_LOAD))
+                gid[v] = -1;
+            home[v] = bb->id + 1;
+        }
+        last[bb->id] = pos;
+    }
+    int nglobal = 0;
+    int *global = calloc(nvar + 1, sizeof(int));
+    for (int v = 0; v < nvar; v++) {
+        if (gid[v] < 0) {
+            global[nglobal] = v;
+            gid[v] = nglobal++;
+        } else {
+            gid[v] = -1;
+        }
+    }
+
+    // local sets of blocks: gen (read before written) and kill (written)
+    int words = nglobal / 64 + 1;
+    unsigned long *sets = calloc((long)nblock * words * 4, sizeof(unsigned long));
+    unsigned long *gen = sets, *kill = gen + (long)nblock * words;
+    unsigned long *live_in = kill + (long)nblock * words, *live_out = live_in + (long)nblock * words;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+        if (!vl->var->vreg && gid[vl->var->index] >= 0)
+            bit_set(&kill[ir->blocks->id * words], gid[vl->var->index]);
+    for (BasicBlock *bb = ir->blocks; bb; bb = bb->next) {
+        unsigned long *g = &gen[bb->id * words], *k = &kill[bb->id * words];
+        for (IR *in = bb->ir; in; in = in->next) {
+            Var *var = NULL;
+            if (in->pattern == IR_LOAD || in->pattern == IR_STORE)
+                var = lvar_of(def, in->a);
+            if (!var || var->vreg || gid[var->index] < 0)
+                continue;
+            int v = gid[var->index];
+            if (in->pattern == IR_STORE)
+                bit_set(k, v);
+            else if (!bit_test(k, v))
+                bit_set(g, v);
+        }
+    }
+
+    // live_in = gen | (live_out & ~kill) until nothing changes
+    BasicBlock **order = calloc(nblock + 1, sizeof(BasicBlock *));
+    int n = 0;
+    for (BasicBlock *bb = ir->blocks; bb; bb = bb->next)
+        order[n++] = bb;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (int i = n - 1; i >= 0; i--) {
+            int b = order[i]->id;
+            BasicBlock *succ[2];
+            int nsucc = ir_succs(order[i], succ);
+            for (int w = 0; w < words; w++) {
+                unsigned long out = 0;
+                for (int j = 0; j < nsucc; j++)
+                    out |= live_in[succ[j]->id * words + w];
+                unsigned long in = gen[b * words + w] | (out & ~kill[b * words + w]);
+                live_out[b * words + w] = out;
+                if (in != live_in[b * words + w]) {
+                    live_in[b * words + w] = in;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // variables live across block boundaries span whole block
+    for (int i = 0; i < n; i++) {
+        int b = order[i]->id;
+        for (int w = 0; w < words; w++) {
+            for (unsigned long bits = live_in[b * words + w]; bits; bits &= bits - 1)
+                extend_range(&range[global[w * 64 + __builtin_ctzl(bits)]], first[b]);
+            for (unsigned long bits = live_out[b * words + w]; bits; bits &= bits - 1)
+                extend_range(&range[global[w * 64 + __builtin_ctzl(bits)]], last[b]);
+        }
+    }
+
+    // linear scan taking lowest free slot
+    VarRange **sorted = calloc(nvar + 1, sizeof(VarRange *));
+    int cnt = 0;
+    for (int v = 0; v < nvar; v++)
+        if (range[v].start >= 0)
+            sorted[cnt++] = &range[v];
+    qsort(sorted, cnt, sizeof(VarRange *), cmp_range_start);
+    int *slot_end = calloc(cnt + 1, sizeof(int));
+    int nslot = 0;
+    slot_weight = calloc(cnt + 1, sizeof(long));
+    for (int i = 0; i < cnt; i++) {
+        VarRange *r = sorted[i];
+        int s = 0;
+        while (s < nslot && slot_end[s] >= r->start)
+            s++;
+        if (s == nslot)
+            nslot++;
+        slot_end[s] = r->end;
+        slot_weight[s] += r->weight;
+        r->slot = s;
+    }
+
+    // heaviest slot gets [rbp-8]
+    int *rank = calloc(nslot + 1, sizeof(int));
+    int *offset = calloc(nslot + 1, sizeof(int));
+    for (int s = 0; s < nslot; s++)
+        rank[s] = s;
+    qsort(rank, nslot, sizeof(int), cmp_slot_weight);
+    for (int i = 0; i < nslot; i++)
+        offset[rank[i]] = (i + 1) * 8;
+
+    // variables never accessed need no slot
+    for (int v = 0; v < nvar; v++)
+        range[v].var->offset = range[v].start >= 0 ? offset[range[v].slot] : 0;
+    fn->stack_size = nslot * 8;
+
+    free(range);
+    free(home);
+    free(gid);
+    free(global);
+    free(sets);
+    free(first);
+    free(last);
+    free(order);
+    free(sorted);
+    free(slot_end);
+    free(slot_weight);
+    free(rank);
+    free(offset);
+}
@@ -0,0 +1,381 @@
+#include "9cc.h"
+
+// variables of callee and their copies in caller
+typedef struct VarMap VarMap;
+struct VarMap {
+    Var **from;
+    Var **to;
+    int n;
+};
+
+// function in call graph
+typedef struct CallNode CallNode;
+struct CallNode {
+    Function *fn;
+    int size; // Number of nodes in body
+    int *callees; // Indices of called functions defined in program
+    int ncallee;
+    int index; // Visit order of SCC search (0 if not visited)
+    int low; // Lowest index reachable in SCC search
+    bool on_stack;
+    bool recursive; // Calls itself directly or through others
+};
+
+// call graph of program
+_Thread_local CallNode *call_nodes;
+_Thread_local int ncall_node;
+_Thread_local int *call_slots; // Open addressing table of node index + 1 by name
+_Thread_local int call_cap;
+_Thread_local int *scc_stack;
+_Thread_local int scc_depth;
+_Thread_local int scc_index;
+_Thread_local int *call_order; // Functions with callees before callers
+_Thread_local int ncall_order;
+
+// call sites run at least this often in profile take larger callees
+// (-1 without profile)
+_Thread_local long hot_call_count;
+
+int count_nodes(Node *node) {
+    int n = 0;
+    for (; node; node = node->next)
+        n += 1 + count_nodes(node->lhs) + count_nodes(node->rhs) + count_nodes(node->cond)
+            + count_nodes(node->then) + count_nodes(node->els) + count_nodes(node->init)
+            + count_nodes(node->inc) + count_nodes(node->stmts) + count_nodes(node->args);
+    return n;
+}
+
+// index of function defined in program (-1 if external)
+int find_call_node(char *name) {
+    unsigned i = hash_string(name, strlen(name)) & (call_cap - 1);
+    for (; call_slots[i]; i = (i + 1) & (call_cap - 1))
+        if (!strcmp(call_nodes[call_slots[i] - 1].fn->name, name))
+            return call_slots[i] - 1;
+    return -1;
+}
+
+void add_call_node(Function *fn) {
+    unsigned i = hash_string(fn->name, strlen(fn->name)) & (call_cap - 1);
+    for (; call_slots[i]; i = (i + 1) & (call_cap - 1))
+        if (!strcmp(call_nodes[call_slots[i] - 1].fn->name, fn->name))
+            return; // duplicate is reported when linking
+    call_nodes[ncall_node] = (CallNode){fn, count_nodes(fn->node)};
+    call_slots[i] = ++ncall_node;
+}
+
+// collect callees of tree
+void find_callees(Node *node, CallNode *cn, int *cap) {
+    for (; node; node = node->next) {
+        if (node->pattern == ND_FUNCALL) {
+            int callee = find_call_node(node->fn_name);
+            if (callee >= 0) {
+                if (cn->ncallee == *cap)
+                    cn->callees = realloc(cn->callees, (*cap = *cap * 2 + 4) * sizeof(int));
+                cn->callees[cn->ncallee++] = callee;
+            }
+        }
+        find_callees(node->lhs, cn, cap);
+        find_callees(node->rhs, cn, cap);
+        find_callees(node->cond, cn, cap);
+        find_callees(node->then, cn, cap);
+        find_callees(node->els, cn, cap);
+        find_callees(node->init, cn, cap);
+        find_callees(node->inc, cn, cap);
+        find_callees(node->stmts, cn, cap);
+        find_callees(node->args, cn, cap);
+    }
+}
+
+// find strongly connected components (Tarjan), appending functions to
+// call_order when their component is complete
+void visit_call_node(int v) {
+    CallNode *cn = &call_nodes[v];
+    cn->index = cn->low = ++scc_index;
+    scc_stack[scc_depth++] = v;
+    cn->on_stack = true;
+
+    for (int i = 0; i < cn->ncallee; i++) {
+        int w = cn->callees[i];
+        if (w == v)
+            cn->recursive = true;
+        if (!call_nodes[w].index) {
+            visit_call_node(w);
+            if (call_nodes[w].low < cn->low)
+                cn->low = call_nodes[w].low;
+        } else if (call_nodes[w].on_stack && call_nodes[w].index < cn->low) {
+            cn->low = call_nodes[w].index;
+        }
+    }
+
+    if (cn->low != cn->index)
+        return;
+    int first = scc_depth;
+    do
+        call_nodes[scc_stack[--first]].on_stack = false;
+    while (scc_stack[first] != v);
+    for (int i = first; i < scc_depth; i++) {
+        if (scc_depth - first > 1)
+            call_nodes[scc_stack[i]].recursive = true;
+        call_order[ncall_order++] = scc_stack[i];
+    }
+    scc_depth = first;
+}
+
+Var *map_var(Var *var, VarMap *map) {
+    for (int i = 0; i < map->n; i++)
+        if (map->from[i] == var)
+            return map->to[i];
+    return var;
+}
+
+Node *clone_node(Node *node, VarMap *map);
+
+Node *clone_list(Node *node, VarMap *map) {
+    Node head = {};
+    Node *cur = &head;
+    for (; node; node = node->next)
+        cur = cur->next = clone_node(node, map);
+    return head.next;
+}
+
+// copy tree of callee with its variables replaced
+Node *clone_node(Node *node, VarMap *map) {
+    if (!node)
+        return NULL;
+    Node *copy = new_node(node->pattern);
+    *copy = *node;
+    copy->next = NULL;
+    copy->lhs = clone_node(node->lhs, map);
+    copy->rhs = clone_node(node->rhs, map);
+    copy->cond = clone_node(node->cond, map);
+    copy->then = clone_node(node->then, map);
+    copy->els = clone_node(node->els, map);
+    copy->init = clone_node(node->init, map);
+    copy->inc = clone_node(node->inc, map);
+    copy->stmts = clone_list(node->stmts, map);
+    copy->args = clone_list(node->args, map);
+    if (node->var)
+        copy->var = map_var(node->var, map);
+    return copy;
+}
+
+// add variable to frame of function
+Var *add_inline_var(Function *fn, char *callee, char *name) {
+    Var *var = arena_alloc(&parse_arena, sizeof(Var));
+    int len = strlen(callee) + strlen(name) + 1;
+    var->name = arena_alloc(&parse_arena, len + 1);
+    snprintf(var->name, len + 1, "%s.%s", callee, name);
+    VarList *vl = arena_alloc(&parse_arena, sizeof(VarList));
+    vl->var = var;
+    vl->next = fn->var_list;
+    fn->var_list = vl;
+    return var;
+}
+
+int count_returns(Node *node) {
+    int n = 0;
+    for (; node; node = node->next)
+        n += (node->pattern == ND_RETURN) + count_returns(node->lhs) + count_returns(node->rhs)
+            + count_returns(node->cond) + count_returns(node->then) + count_returns(node->els)
+            + count_returns(node->init) + count_returns(node->inc) + count_returns(node->stmts)
+            + count_returns(node->args);
+    return n;
+}
+
+// replace call by body of callee
+void inline_call(Function *fn, Node *call, Function *callee) {
+    // copies of variables keep order of callee frame
+    VarMap map = {};
+    for (VarList *vl = callee->var_list; vl; vl = vl->next)
+        map.n++;
+    map.from = calloc(map.n + 1, sizeof(Var *));
+    map.to = calloc(map.n + 1, sizeof(Var *));
+    int i = map.n;
+    for (VarList *vl = callee->var_list; vl; vl = vl->next)
+        map.from[--i] = vl->var;
+    for (i = 0; i < map.n; i++)
+        map.to[i] = add_inline_var(fn, callee->name, map.from[i]->name);
+
+    // parameters are assigned in order of arguments
+    Node head = {};
+    Node *cur = &head;
+    Node *arg = call->args;
+    for (VarList *param = callee->params; param; param = param->next) {
+        Node *next = arg->next;
+        Node *var = new_node(ND_VAR);
+        var->var = map_var(param->var, &map);
+        arg->next = NULL;
+        cur = cur->next = new_binary(ND_ASSIGN, var, arg);
+        arg = next;
+    }
+    cur->next = clone_list(callee->node, &map);
+
+    Node *node = new_node(ND_INLINE);
+    node->stmts = head.next;
+    node->fn_name = callee->name;
+    node->count = callee->count;
+
+    // body ending in its only return gives value without result variable
+    Node *last = NULL;
+    for (Node *n = node->stmts; n; n = n->next)
+        last = n;
+    if (last && last->pattern == ND_RETURN && count_returns(node->stmts) == 1) {
+        Node *prev = &head;
+        prev->next = node->stmts;
+        while (prev->next != last)
+            prev = prev->next;
+        prev->next = NULL;
+        node->stmts = head.next;
+        node->lhs = last->lhs;
+    } else {
+        node->var = add_inline_var(fn, callee->name, "ret");
+    }
+
+    node->next = call->next;
+    *call = *node;
+    free(map.from);
+    free(map.to);
+}
+
+// profiled runs of children of node which has run count times
+long cond_count(Node *node, long count) {
+    if (node->pattern == ND_WHILE || node->pattern == ND_FOR)
+        return edge_count(node, 0) < 0 ? -1 : edge_count(node, 0) + edge_count(node, 1);
+    return count;
+}
+
+long then_count(Node *node, long count) {
+    if (node->pattern == ND_IF || node->pattern == ND_WHILE || node->pattern == ND_FOR)
+        return edge_count(node, 0);
+    return count;
+}
+
+long else_count(Node *node, long count) {
+    return node->pattern == ND_IF ? edge_count(node, 1) : count;
+}
+
+// collect profiled runs of calls to functions of program
+void collect_call_counts(Node *node, long count, long **counts, int *n, int *cap) {
+    for (; node; node = node->next) {
+        if (node->pattern == ND_FUNCALL && count >= 0 && find_call_node(node->fn_name) >= 0) {
+            if (*n == *cap)
+                *counts = realloc(*counts, (*cap = *cap * 2 + 16) * sizeof(long));
+            (*counts)[(*n)++] = count;
+        }
+        collect_call_counts(node->lhs, count, counts, n, cap);
+        collect_call_counts(node->rhs, count, counts, n, cap);
+        collect_call_counts(node->cond, cond_count(node, count), counts, n, cap);
+        collect_call_counts(node->then, then_count(node, count), counts, n, cap);
+        collect_call_counts(node->els, else_count(node, count), counts, n, cap);
+        collect_call_counts(node->init, count, counts, n, cap);
+        collect_call_counts(node->inc, then_count(node, count), counts, n, cap);
+        collect_call_counts(node->stmts, count, counts, n, cap);
+        collect_call_counts(node->args, count, counts, n, cap);
+    }
+}
+
+int cmp_count_desc(const void *a, const void *b) {
+    long x = *(long *)a, y = *(long *)b;
+    return x == y ? 0 : x > y ? -1 : 1;
+}
+
+// rank call sites by profiled runs; most frequent ones making up 90% of
+// all calls are hot
+void rank_call_sites() {
+    long *counts = NULL;
+    int n = 0, cap = 0;
+    for (int i = 0; i < ncall_node; i++)
+        collect_call_counts(call_nodes[i].fn->node, entry_count(call_nodes[i].fn), &counts, &n, &cap);
+    hot_call_count = -1;
+    long total = 0;
+    for (int i = 0; i < n; i++)
+        total += counts[i];
+    qsort(counts, n, sizeof(long), cmp_count_desc);
+    long sum = 0;
+    for (int i = 0; i < n && counts[i] > 0; i++) {
+        hot_call_count = counts[i];
+        sum += counts[i];
+        if (sum * 10 >= total * 9)
+            break;
+    }
+    free(counts);
+}
+
+// inline small callees at call sites of tree (larger ones at hot sites,
+// none at sites never run)
+void inline_calls(Function *fn, Node *node, long count) {
+    for (; node; node = node->next) {
+        inline_calls(fn, node->lhs, count);
+        inline_calls(fn, node->rhs, count);
+        inline_calls(fn, node->cond, cond_count(node, count));
+        inline_calls(fn, node->then, then_count(node, count));
+        inline_calls(fn, node->els, else_count(node, count));
+        inline_calls(fn, node->init, count);
+        inline_calls(fn, node->inc, then_count(node, count));
+        inline_calls(fn, node->stmts, count);
+        inline_calls(fn, node->args, count);
+        if (node->pattern != ND_FUNCALL)
+            continue;
+
+        int i = find_call_node(node->fn_name);
+        if (i < 0)
+            continue;
+        CallNode *callee = &call_nodes[i];
+        int limit = opt_inline_limit;
+        if (hot_call_count > 0 && count >= hot_call_count)
+            limit *= 4;
+        if (callee->recursive || callee->fn == fn || callee->size > limit || !count)
+            continue;
+        int nparam = 0, narg = 0;
+        for (VarList *vl = callee->fn->params; vl; vl = vl->next)
+            nparam++;
+        for (Node *arg = node->args; arg; arg = arg->next)
+            narg++;
+        if (nparam == narg)
+            inline_call(fn, node, callee->fn);
+    }
+}
+
+// substitute bodies of small non-recursive functions at their calls
+void inline_functions(Function *program) {
+    int n = 0;
+    for (Function *fn = program; fn; fn = fn->next)
+        n++;
+    call_nodes = calloc(n + 1, sizeof(CallNode));
+    ncall_node = 0;
+    for (call_cap = 16; call_cap < n * 2; call_cap *= 2)
+        ;
+    call_slots = calloc(call_cap, sizeof(int));
+    // functions taken from cache without tree are called only by others
+    // taken so (their keys cover callees)
+    for (Function *fn = program; fn; fn = fn->next)
+        add_call_node(fn);
+
+    for (int i = 0; i < ncall_node; i++) {
+        int cap = 0;
+        find_callees(call_nodes[i].fn->node, &call_nodes[i], &cap);
+    }
+
+    rank_call_sites();
+
+    scc_stack = calloc(ncall_node + 1, sizeof(int));
+    call_order = calloc(ncall_node + 1, sizeof(int));
+    scc_depth = scc_index = ncall_order = 0;
+    for (int i = 0; i < ncall_node; i++)
+        if (!call_nodes[i].index)
+            visit_call_node(i);
+
+    // callees are expanded before their callers take them
+    for (int i = 0; i < ncall_order; i++) {
+        CallNode *cn = &call_nodes[call_order[i]];
+        inline_calls(cn->fn, cn->fn->node, entry_count(cn->fn));
+        cn->size = count_nodes(cn->fn->node);
+    }
+
+    for (int i = 0; i < ncall_node; i++)
+        free(call_nodes[i].callees);
+    free(call_nodes);
+    free(call_slots);
+    free(scc_stack);
+    free(call_order);
+}
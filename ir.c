@@ -0,0 +1,447 @@
+#include "9cc.h"
+
+// function being lowered
+_Thread_local IRFunc *ir_fn;
+_Thread_local BasicBlock *cur_bb;
+_Thread_local BasicBlock *tail_bb;
+
+// inlined function being lowered (NULL join in function itself)
+_Thread_local BasicBlock *inline_join;
+_Thread_local Var *inline_result;
+
+// tail calls may reuse frame (no address of local escapes)
+_Thread_local bool tail_calls;
+_Thread_local BasicBlock *self_head; // Target of self-recursive tail calls
+
+// blocks of branch never taken in profile are cold
+_Thread_local bool in_cold;
+
+int lower_expr(Node *node);
+void lower_stmt(Node *node);
+
+BasicBlock *new_bb() {
+    BasicBlock *bb = arena_alloc(&codegen_arena, sizeof(BasicBlock));
+    bb->id = ir_fn->nblock++;
+    bb->cold = in_cold;
+    return bb;
+}
+
+bool is_ir_terminator(IR *ir) {
+    return ir && (ir->pattern == IR_JMP || ir->pattern == IR_BR || ir->pattern == IR_RET
+                  || ir->pattern == IR_TAILCALL);
+}
+
+// append block to layout and continue emitting into it
+void start_bb(BasicBlock *bb);
+
+IR *new_ir(IRPattern pattern) {
+    // code after return or jump lives in its own unreachable block
+    if (is_ir_terminator(cur_bb->last))
+        start_bb(new_bb());
+
+    IR *ir = arena_alloc(&codegen_arena, sizeof(IR));
+    ir->pattern = pattern;
+    if (cur_bb->last)
+        cur_bb->last->next = ir;
+    else
+        cur_bb->ir = ir;
+    cur_bb->last = ir;
+    return ir;
+}
+
+void jump_to(BasicBlock *bb) {
+    new_ir(IR_JMP)->then = bb;
+}
+
+void start_bb(BasicBlock *bb) {
+    // fall through into new block
+    if (cur_bb && !is_ir_terminator(cur_bb->last))
+        jump_to(bb);
+
+    if (tail_bb)
+        tail_bb->next = bb;
+    else
+        ir_fn->blocks = bb;
+    tail_bb = bb;
+    cur_bb = bb;
+}
+
+// emit instruction defining new value
+int emit_value(IRPattern pattern, int a, int b) {
+    IR *ir = new_ir(pattern);
+    ir->dst = ++ir_fn->nvalue;
+    ir->a = a;
+    ir->b = b;
+    return ir->dst;
+}
+
+int emit_imm(long val) {
+    IR *ir = new_ir(IR_IMM);
+    ir->dst = ++ir_fn->nvalue;
+    ir->imm = val;
+    return ir->dst;
+}
+
+void branch(int cond, BasicBlock *then, BasicBlock *els) {
+    IR *ir = new_ir(IR_BR);
+    ir->a = cond;
+    ir->then = then;
+    ir->els = els;
+}
+
+// bump profile counter of edge in instrumented build
+void count_edge(long *count, int edge) {
+    if (!opt_profile_generate || !count)
+        return;
+    new_ir(IR_COUNT)->imm = counter_offset(&count[edge]);
+}
+
+int lower_addr(Node *node) {
+    switch (node->pattern) {
+    case ND_VAR: {
+        IR *ir = new_ir(IR_LVAR);
+        ir->dst = ++ir_fn->nvalue;
+        ir->var = node->var;
+        return ir->dst;
+    }
+    case ND_DEREF:
+        return lower_expr(node->lhs);
+    }
+    error("not an left value");
+}
+
+// evaluate arguments and emit call instruction
+IR *lower_call(Node *node, IRPattern pattern) {
+    int args[6];
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+        if (nargs == 6)
+            error("too many arguments: %s", node->fn_name);
+        args[nargs++] = lower_expr(arg);
+    }
+
+    IR *ir = new_ir(pattern);
+    ir->sym = node->fn_name;
+    ir->nargs = nargs;
+    ir->args = arena_alloc(&codegen_arena, sizeof(int) * (nargs + 1));
+    memcpy(ir->args, args, sizeof(int) * nargs);
+    return ir;
+}
+
+// block after entry, which self-recursive tail calls jump back to
+BasicBlock *loop_head() {
+    if (self_head)
+        return self_head;
+
+    // new entry block only falls into former one
+    self_head = ir_fn->blocks;
+    BasicBlock *entry = new_bb();
+    IR *jmp = arena_alloc(&codegen_arena, sizeof(IR));
+    jmp->pattern = IR_JMP;
+    jmp->then = self_head;
+    entry->ir = entry->last = jmp;
+    entry->next = ir_fn->blocks;
+    ir_fn->blocks = entry;
+    return self_head;
+}
+
+// return value of call in tail position
+void lower_tail_call(Node *node) {
+    Function *fn = ir_fn->fn;
+    int nparams = 0, nargs = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next)
+        nparams++;
+    for (Node *arg = node->args; arg; arg = arg->next)
+        nargs++;
+    if (node->fn_name != fn->name || nargs != nparams || nargs > 6) {
+        lower_call(node, IR_TAILCALL);
+        return;
+    }
+
+    // self recursion reassigns parameters and starts over
+    int args[6];
+    int i = 0;
+    for (Node *arg = node->args; arg; arg = arg->next)
+        args[i++] = lower_expr(arg);
+    i = 0;
+    for (VarList *vl = fn->params; vl; vl = vl->next) {
+        Node var = {ND_VAR};
+        var.var = vl->var;
+        int addr = lower_addr(&var);
+        IR *ir = new_ir(IR_STORE);
+        ir->a = addr;
+        ir->b = args[i++];
+    }
+    jump_to(loop_head());
+}
+
+// lower expression and return value holding its result
+int lower_expr(Node *node) {
+    static IRPattern binary[] = {
+        [ND_ADD] = IR_ADD, [ND_SUB] = IR_SUB, [ND_MUL] = IR_MUL, [ND_DIV] = IR_DIV,
+        [ND_EQ] = IR_EQ, [ND_NE] = IR_NE, [ND_LT] = IR_LT, [ND_LE] = IR_LE,
+    };
+
+    switch (node->pattern) {
+    case ND_NUM:
+        return emit_imm(node->val);
+    case ND_VAR:
+        return emit_value(IR_LOAD, lower_addr(node), 0);
+    case ND_ADDR:
+        return lower_addr(node->lhs);
+    case ND_DEREF:
+        return emit_value(IR_LOAD, lower_expr(node->lhs), 0);
+    case ND_ASSIGN: {
+        int addr = lower_addr(node->lhs);
+        int val = lower_expr(node->rhs);
+        IR *ir = new_ir(IR_STORE);
+        ir->a = addr;
+        ir->b = val;
+        return val;
+    }
+    case ND_NEG:
+        return emit_value(IR_NEG, lower_expr(node->lhs), 0);
+    case ND_FUNCALL: {
+        IR *ir = lower_call(node, IR_CALL);
+        ir->dst = ++ir_fn->nvalue;
+        return ir->dst;
+    }
+    case ND_INLINE: {
+        BasicBlock *join = inline_join;
+        Var *result = inline_result;
+        inline_join = node->var ? new_bb() : NULL;
+        inline_result = node->var;
+        count_edge(node->count, 0);
+
+        // returns store result and leave body
+        for (Node *n = node->stmts; n; n = n->next)
+            lower_stmt(n);
+        int val;
+        if (node->var) {
+            start_bb(inline_join);
+            Node var = {ND_VAR};
+            var.var = node->var;
+            val = emit_value(IR_LOAD, lower_addr(&var), 0);
+        } else {
+            val = lower_expr(node->lhs);
+        }
+
+        inline_join = join;
+        inline_result = result;
+        return val;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE: {
+        int lhs = lower_expr(node->lhs);
+        int rhs = lower_expr(node->rhs);
+        return emit_value(binary[node->pattern], lhs, rhs);
+    }
+    }
+
+    // statement used as expression
+    lower_stmt(node);
+    return 0;
+}
+
+// check whether profile says edge of branch is never taken while other is
+bool is_cold_edge(Node *node, int edge) {
+    return !edge_count(node, edge) && edge_count(node, !edge) > 0;
+}
+
+// lower arm of if statement into its block and go to join
+void lower_arm(Node *node, int edge, BasicBlock *bb, Node *stmt, BasicBlock *join) {
+    bool cold = in_cold;
+    if (is_cold_edge(node, edge))
+        in_cold = bb->cold = true;
+    start_bb(bb);
+    count_edge(node->count, edge);
+    if (stmt)
+        lower_stmt(stmt);
+    if (!is_ir_terminator(cur_bb->last))
+        jump_to(join);
+    in_cold = cold;
+}
+
+void lower_stmt(Node *node) {
+    switch (node->pattern) {
+    case ND_IF: {
+        // instrumented build counts else edge in block of its own
+        BasicBlock *then = new_bb();
+        BasicBlock *els = node->els || opt_profile_generate ? new_bb() : NULL;
+        BasicBlock *join = new_bb();
+
+        branch(lower_expr(node->cond), then, els ? els : join);
+        if (!els) {
+            lower_arm(node, 0, then, node->then, join);
+        } else if (edge_count(node, 1) > edge_count(node, 0)) {
+            // arm taken more often falls through from branch
+            lower_arm(node, 1, els, node->els, join);
+            lower_arm(node, 0, then, node->then, join);
+        } else {
+            lower_arm(node, 0, then, node->then, join);
+            lower_arm(node, 1, els, node->els, join);
+        }
+        start_bb(join);
+        return;
+    }
+    case ND_WHILE:
+    case ND_FOR: {
+        BasicBlock *cond = new_bb();
+        BasicBlock *body = new_bb();
+        BasicBlock *end = new_bb();
+
+        if (node->init)
+            lower_expr(node->init);
+        start_bb(cond);
+        if (node->cond)
+            branch(lower_expr(node->cond), body, end);
+        bool cold = in_cold;
+        if (is_cold_edge(node, 0))
+            in_cold = body->cold = true;
+        start_bb(body);
+        count_edge(node->count, 0);
+        lower_stmt(node->then);
+        if (node->inc)
+            lower_expr(node->inc);
+        jump_to(cond);
+        in_cold = cold;
+        start_bb(end);
+        count_edge(node->count, 1);
+        return;
+    }
+    case ND_RETURN: {
+        if (tail_calls && !inline_join && node->lhs->pattern == ND_FUNCALL) {
+            lower_tail_call(node->lhs);
+            return;
+        }
+        int val = lower_expr(node->lhs);
+        if (inline_join) {
+            Node var = {ND_VAR};
+            var.var = inline_result;
+            int addr = lower_addr(&var);
+            IR *ir = new_ir(IR_STORE);
+            ir->a = addr;
+            ir->b = val;
+            jump_to(inline_join);
+            return;
+        }
+        new_ir(IR_RET)->a = val;
+        return;
+    }
+    case ND_BLOCK:
+        for (Node *n = node->stmts; n; n = n->next)
+            lower_stmt(n);
+        return;
+    }
+
+    lower_expr(node);
+}
+
+// lower function body to control flow graph
+IRFunc *lower_function(Function *fn) {
+    ir_fn = arena_alloc(&codegen_arena, sizeof(IRFunc));
+    ir_fn->fn = fn;
+    cur_bb = tail_bb = NULL;
+    inline_join = NULL;
+    tail_calls = opt_tail_calls && !has_addr(fn->node);
+    self_head = NULL;
+    in_cold = false;
+
+    start_bb(new_bb());
+    count_edge(fn->count, 0);
+    for (Node *n = fn->node; n; n = n->next)
+        lower_stmt(n);
+    if (!is_ir_terminator(cur_bb->last))
+        new_ir(IR_RET);
+    return ir_fn;
+}
+
+// successors of block
+int ir_succs(BasicBlock *bb, BasicBlock **succ) {
+    IR *last = bb->last;
+    switch (last->pattern) {
+    case IR_JMP:
+        succ[0] = last->then;
+        return 1;
+    case IR_BR:
+        succ[0] = last->then;
+        succ[1] = last->els;
+        return 2;
+    }
+    return 0;
+}
+
+// collect pointers to operand values of instruction
+int ir_operands(IR *ir, int **opd) {
+    int n = 0;
+    if (ir->pattern == IR_CALL || ir->pattern == IR_TAILCALL) {
+        for (int i = 0; i < ir->nargs; i++)
+            opd[n++] = &ir->args[i];
+        return n;
+    }
+    if (ir->a)
+        opd[n++] = &ir->a;
+    if (ir->b)
+        opd[n++] = &ir->b;
+    return n;
+}
+
+// print IR of function to stderr
+void dump_ir(IRFunc *fn, char *title) {
+    static char *name[] = {
+        [IR_IMM] = "imm", [IR_LVAR] = "lvar", [IR_ADD] = "add", [IR_SUB] = "sub",
+        [IR_MUL] = "mul", [IR_DIV] = "div", [IR_EQ] = "eq", [IR_NE] = "ne",
+        [IR_LT] = "lt", [IR_LE] = "le", [IR_NEG] = "neg", [IR_COPY] = "copy",
+        [IR_LOAD] = "load", [IR_STORE] = "store", [IR_CALL] = "call",
+        [IR_JMP] = "jmp", [IR_BR] = "br", [IR_RET] = "ret", [IR_TAILCALL] = "tailcall",
+        [IR_COUNT] = "count",
+    };
+
+    fprintf(stderr, "; %s: %s\n", fn->fn->name, title);
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        fprintf(stderr, "bb%d:\n", bb->id);
+        for (IR *ir = bb->ir; ir; ir = ir->next) {
+            fprintf(stderr, "    ");
+            if (ir->dst)
+                fprintf(stderr, "v%d = ", ir->dst);
+            fprintf(stderr, "%s", name[ir->pattern]);
+
+            switch (ir->pattern) {
+            case IR_IMM:
+                fprintf(stderr, " %ld", ir->imm);
+                break;
+            case IR_LVAR:
+                fprintf(stderr, " %s", ir->var->name);
+                break;
+            case IR_COUNT:
+                fprintf(stderr, " %ld", ir->imm);
+                break;
+            case IR_CALL:
+            case IR_TAILCALL:
+                fprintf(stderr, " %s(", ir->sym);
+                for (int i = 0; i < ir->nargs; i++)
+                    fprintf(stderr, "%sv%d", i ? ", " : "", ir->args[i]);
+                fprintf(stderr, ")");
+                break;
+            case IR_JMP:
+                fprintf(stderr, " bb%d", ir->then->id);
+                break;
+            case IR_BR:
+                fprintf(stderr, " v%d, bb%d, bb%d", ir->a, ir->then->id, ir->els->id);
+                break;
+            default:
+                if (ir->a)
+                    fprintf(stderr, " v%d", ir->a);
+                if (ir->b)
+                    fprintf(stderr, ", v%d", ir->b);
+            }
+            fprintf(stderr, "\n");
+        }
+    }
+}
@@ -0,0 +1,398 @@
+#include "9cc.h"
+
+// map each value to instruction defining it
+IR **value_defs(IRFunc *fn) {
+    IR **def = arena_alloc(&codegen_arena, sizeof(IR *) * (fn->nvalue + 1));
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+            if (ir->dst)
+                def[ir->dst] = ir;
+    return def;
+}
+
+// number reachable blocks in reverse postorder and return them in that order
+BasicBlock **compute_rpo(IRFunc *fn, int *n) {
+    BasicBlock **order = arena_alloc(&codegen_arena, sizeof(BasicBlock *) * (fn->nblock + 1));
+    BasicBlock **stack = arena_alloc(&codegen_arena, sizeof(BasicBlock *) * (fn->nblock + 1));
+    int *next_succ = arena_alloc(&codegen_arena, sizeof(int) * (fn->nblock + 1));
+    bool *seen = arena_alloc(&codegen_arena, sizeof(bool) * (fn->nblock + 1));
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        bb->rpo = -1;
+
+    // iterative depth first search collecting postorder from the back
+    int cnt = 0, sp = 0;
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        cnt++;
+    int pos = cnt;
+    stack[sp++] = fn->blocks;
+    seen[fn->blocks->id] = true;
+    while (sp) {
+        BasicBlock *bb = stack[sp - 1];
+        BasicBlock *succ[2];
+        int nsucc = ir_succs(bb, succ);
+        if (next_succ[bb->id] < nsucc) {
+            BasicBlock *s = succ[next_succ[bb->id]++];
+            if (!seen[s->id]) {
+                seen[s->id] = true;
+                stack[sp++] = s;
+            }
+            continue;
+        }
+        order[--pos] = bb;
+        sp--;
+    }
+
+    // shift reachable blocks to the front
+    *n = cnt - pos;
+    for (int i = 0; i < *n; i++) {
+        order[i] = order[pos + i];
+        order[i]->rpo = i;
+    }
+    return order;
+}
+
+BasicBlock *intersect_dom(BasicBlock *a, BasicBlock *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo)
+            a = a->idom;
+        while (b->rpo > a->rpo)
+            b = b->idom;
+    }
+    return a;
+}
+
+// compute immediate dominators (Cooper, Harvey and Kennedy)
+BasicBlock **compute_dominators(IRFunc *fn, int *n) {
+    BasicBlock **order = compute_rpo(fn, n);
+
+    // predecessors of reachable blocks packed into one array
+    int *npred = arena_alloc(&codegen_arena, sizeof(int) * (fn->nblock + 1));
+    BasicBlock ***pred = arena_alloc(&codegen_arena, sizeof(BasicBlock **) * (fn->nblock + 1));
+    BasicBlock **edges = arena_alloc(&codegen_arena, sizeof(BasicBlock *) * (*n * 2 + 1));
+    for (int i = 0; i < *n; i++) {
+        BasicBlock *succ[2];
+        int nsucc = ir_succs(order[i], succ);
+        for (int j = 0; j < nsucc; j++)
+            npred[succ[j]->id]++;
+        order[i]->idom = NULL;
+    }
+    for (int i = 0, used = 0; i < *n; i++) {
+        pred[order[i]->id] = edges + used;
+        used += npred[order[i]->id];
+        npred[order[i]->id] = 0;
+    }
+    for (int i = 0; i < *n; i++) {
+        BasicBlock *succ[2];
+        int nsucc = ir_succs(order[i], succ);
+        for (int j = 0; j < nsucc; j++)
+            pred[succ[j]->id][npred[succ[j]->id]++] = order[i];
+    }
+
+    order[0]->idom = order[0];
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < *n; i++) {
+            BasicBlock *bb = order[i];
+            BasicBlock *idom = NULL;
+            for (int j = 0; j < npred[bb->id]; j++) {
+                BasicBlock *p = pred[bb->id][j];
+                if (!p->idom)
+                    continue;
+                idom = idom ? intersect_dom(p, idom) : p;
+            }
+            if (bb->idom != idom) {
+                bb->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    return order;
+}
+
+bool dominates(BasicBlock *a, BasicBlock *b) {
+    while (b != a && b->idom != b)
+        b = b->idom;
+    return a == b;
+}
+
+// turn branches on constants into jumps and drop blocks never reached
+void remove_unreachable(IRFunc *fn) {
+    IR **def = value_defs(fn);
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        IR *last = bb->last;
+        if (last->pattern != IR_BR || def[last->a]->pattern != IR_IMM)
+            continue;
+        if (!def[last->a]->imm)
+            last->then = last->els;
+        last->pattern = IR_JMP;
+        last->a = 0;
+        last->els = NULL;
+    }
+
+    int n;
+    compute_rpo(fn, &n);
+    BasicBlock head = {};
+    BasicBlock *cur = &head;
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        if (bb->rpo >= 0)
+            cur = cur->next = bb;
+    cur->next = NULL;
+    fn->blocks = head.next;
+}
+
+// available expression
+typedef struct CSEEntry CSEEntry;
+struct CSEEntry {
+    IRPattern pattern; // Operation
+    long x, y; // Operands (value numbers, immediate or variable)
+    int value; // Value computing expression
+    BasicBlock *bb; // Block of value
+};
+
+typedef struct CSETable CSETable;
+struct CSETable {
+    CSEEntry *entries;
+    int cap;
+};
+
+unsigned cse_hash(IRPattern pattern, long x, long y) {
+    unsigned long h = pattern * 0x9E3779B97F4A7C15UL;
+    h = (h ^ x) * 0xBF58476D1CE4E5B9UL;
+    h = (h ^ y) * 0x94D049BB133111EBUL;
+    return h ^ (h >> 31);
+}
+
+// find value of expression computed in block dominating bb (0 if none)
+int cse_find(CSETable *t, IRPattern pattern, long x, long y, BasicBlock *bb) {
+    for (unsigned i = cse_hash(pattern, x, y) & (t->cap - 1); t->entries[i].value;
+         i = (i + 1) & (t->cap - 1)) {
+        CSEEntry *e = &t->entries[i];
+        if (e->pattern == pattern && e->x == x && e->y == y && (!bb || dominates(e->bb, bb)))
+            return e->value;
+    }
+    return 0;
+}
+
+void cse_insert(CSETable *t, IRPattern pattern, long x, long y, int value, BasicBlock *bb) {
+    unsigned i = cse_hash(pattern, x, y) & (t->cap - 1);
+    while (t->entries[i].value)
+        i = (i + 1) & (t->cap - 1);
+    t->entries[i] = (CSEEntry){pattern, x, y, value, bb};
+}
+
+bool is_commutative(IRPattern pattern) {
+    return pattern == IR_ADD || pattern == IR_MUL || pattern == IR_EQ || pattern == IR_NE;
+}
+
+// replace recomputed expressions by value computed in dominating block
+// and loads by value already loaded or stored since last store or call
+void eliminate_common_subexpr(IRFunc *fn) {
+    int n;
+    BasicBlock **order = compute_dominators(fn, &n);
+
+    int ninst = 0;
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next)
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+            ninst++;
+    CSETable t = {};
+    for (t.cap = 16; t.cap < ninst * 4; t.cap *= 2)
+        ;
+    t.entries = arena_alloc(&codegen_arena, sizeof(CSEEntry) * t.cap);
+
+    // value number of each value
+    int *vn = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    for (int v = 0; v <= fn->nvalue; v++)
+        vn[v] = v;
+
+    long epoch = 0;
+    for (int i = 0; i < n; i++) {
+        BasicBlock *bb = order[i];
+        epoch++;
+
+        for (IR *ir = bb->ir; ir; ir = ir->next) {
+            int found;
+            switch (ir->pattern) {
+            case IR_IMM:
+            case IR_LVAR: {
+                // leaves are cheap to rematerialize, so only share their number
+                long x = ir->pattern == IR_IMM ? ir->imm : (long)ir->var;
+                found = cse_find(&t, ir->pattern, x, 0, NULL);
+                if (found)
+                    vn[ir->dst] = vn[found];
+                else
+                    cse_insert(&t, ir->pattern, x, 0, ir->dst, bb);
+                continue;
+            }
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:
+            case IR_EQ:
+            case IR_NE:
+            case IR_LT:
+            case IR_LE:
+            case IR_NEG: {
+                long x = vn[ir->a], y = vn[ir->b];
+                if (is_commutative(ir->pattern) && x > y) {
+                    long tmp = x;
+                    x = y;
+                    y = tmp;
+                }
+                found = cse_find(&t, ir->pattern, x, y, bb);
+                if (!found) {
+                    cse_insert(&t, ir->pattern, x, y, ir->dst, bb);
+                    continue;
+                }
+                break;
+            }
+            case IR_LOAD:
+                found = cse_find(&t, IR_LOAD, vn[ir->a], epoch, NULL);
+                if (!found) {
+                    cse_insert(&t, IR_LOAD, vn[ir->a], epoch, ir->dst, bb);
+                    continue;
+                }
+                break;
+            case IR_STORE:
+                epoch++;
+                cse_insert(&t, IR_LOAD, vn[ir->a], epoch, ir->b, bb);
+                continue;
+            case IR_CALL:
+            case IR_TAILCALL:
+                epoch++;
+                continue;
+            default:
+                continue;
+            }
+
+            ir->pattern = IR_COPY;
+            ir->a = found;
+            ir->b = 0;
+            vn[ir->dst] = vn[found];
+        }
+    }
+}
+
+// replace uses of copies by their sources
+void propagate_copies(IRFunc *fn) {
+    int n;
+    BasicBlock **order = compute_rpo(fn, &n);
+    int *repr = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    for (int v = 0; v <= fn->nvalue; v++)
+        repr[v] = v;
+
+    for (int i = 0; i < n; i++) {
+        for (IR *ir = order[i]->ir; ir; ir = ir->next) {
+            int *opd[6];
+            int nopd = ir_operands(ir, opd);
+            for (int j = 0; j < nopd; j++)
+                *opd[j] = repr[*opd[j]];
+            if (ir->pattern == IR_COPY)
+                repr[ir->dst] = ir->a;
+        }
+    }
+}
+
+// instruction without effect other than defining its value
+bool is_removable(IR *ir) {
+    switch (ir->pattern) {
+    case IR_STORE:
+    case IR_CALL:
+    case IR_JMP:
+    case IR_BR:
+    case IR_RET:
+    case IR_TAILCALL:
+    case IR_COUNT:
+        return false;
+    }
+    return true;
+}
+
+// remove instructions whose values are never used
+void eliminate_dead_code(IRFunc *fn) {
+    int *uses = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    IR **def = value_defs(fn);
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        for (IR *ir = bb->ir; ir; ir = ir->next) {
+            int *opd[6];
+            int nopd = ir_operands(ir, opd);
+            for (int j = 0; j < nopd; j++)
+                uses[*opd[j]]++;
+        }
+    }
+
+    // release operands of dead instructions transitively
+    int *work = arena_alloc(&codegen_arena, sizeof(int) * (fn->nvalue + 1));
+    bool *dead = arena_alloc(&codegen_arena, sizeof(bool) * (fn->nvalue + 1));
+    int nwork = 0;
+    for (int v = 1; v <= fn->nvalue; v++)
+        if (def[v] && !uses[v] && is_removable(def[v]))
+            work[nwork++] = v;
+    while (nwork) {
+        int v = work[--nwork];
+        dead[v] = true;
+        int *opd[6];
+        int nopd = ir_operands(def[v], opd);
+        for (int j = 0; j < nopd; j++) {
+            int u = *opd[j];
+            if (--uses[u] == 0 && is_removable(def[u]))
+                work[nwork++] = u;
+        }
+    }
+
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        IR head = {};
+        IR *cur = &head;
+        for (IR *ir = bb->ir; ir; ir = ir->next)
+            if (!ir->dst || !dead[ir->dst])
+                cur = cur->next = ir;
+        cur->next = NULL;
+        bb->ir = head.next;
+        bb->last = cur;
+    }
+}
+
+// move blocks never reached in profile after hot ones, so hot paths fall
+// through and cold code does not occupy their cache lines
+void layout_blocks(IRFunc *fn) {
+    BasicBlock hot = {}, cold = {};
+    BasicBlock *h = &hot, *c = &cold;
+    for (BasicBlock *bb = fn->blocks; bb; bb = bb->next) {
+        if (bb->cold && bb != fn->blocks)
+            c = c->next = bb;
+        else
+            h = h->next = bb;
+    }
+    h->next = cold.next;
+    c->next = NULL;
+    fn->blocks = hot.next;
+}
+
+// IR optimization pass
+typedef struct IRPass IRPass;
+struct IRPass {
+    char *name; // Name shown in dumps
+    void (*run)(IRFunc *fn); // Transformation
+};
+
+IRPass ir_passes[] = {
+    {"unreachable", remove_unreachable},
+    {"cse", eliminate_common_subexpr},
+    {"copyprop", propagate_copies},
+    {"dce", eliminate_dead_code},
+    {"layout", layout_blocks},
+};
+
+// run pass pipeline over function
+void run_ir_passes(IRFunc *fn) {
+    if (opt_dump_ir)
+        dump_ir(fn, "lowered");
+    if (!opt_ir_opt)
+        return;
+
+    for (int i = 0; i < sizeof(ir_passes) / sizeof(*ir_passes); i++) {
+        ir_passes[i].run(fn);
+        if (opt_dump_ir)
+            dump_ir(fn, ir_passes[i].name);
+    }
+}
@@ -0,0 +1,81 @@
+#include "9cc.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define STUB_SIZE 16
+
+// make symbols of shared library visible to generated code
+void jit_load(char *path) {
+    if (!dlopen(path, RTLD_NOW | RTLD_GLOBAL))
+        error("cannot load %s: %s", path, dlerror());
+}
+
+// write "jmp [rip+0]" followed by absolute address
+void put_stub(char *p, void *addr) {
+    p[0] = 0xff;
+    p[1] = 0x25;
+    memset(p + 2, 0, 4);
+    memcpy(p + 6, &addr, 8);
+}
+
+// map object into memory (code, stubs, read-only data and .bss on their own
+// pages), call main and return its value
+int jit_run(Object *obj) {
+    // external functions may be far away, so calls go through stubs after text
+    long page = sysconf(_SC_PAGESIZE);
+    long text_size = (obj->text.len + STUB_SIZE - 1) & ~(long)(STUB_SIZE - 1);
+    long code_size = (text_size + (long)obj->nsym * STUB_SIZE + page - 1) & ~(page - 1);
+    long rodata_size = (obj->rodata.len + page - 1) & ~(page - 1);
+    long size = code_size + rodata_size + obj->bss_size;
+    char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        error("cannot map code: %s", strerror(errno));
+    memcpy(mem, obj->text.data, obj->text.len);
+    memcpy(mem + code_size, obj->rodata.data, obj->rodata.len);
+    char *section[] = {[SC_TEXT] = mem, [SC_RODATA] = mem + code_size,
+                       [SC_BSS] = mem + code_size + rodata_size};
+
+    bool *resolved = calloc(obj->nsym + 1, sizeof(bool));
+    for (int i = 0; i < obj->nreloc; i++) {
+        ObjReloc *rel = &obj->relocs[i];
+        ObjSym *sym = &obj->syms[rel->sym];
+        char *target = mem + text_size + (long)rel->sym * STUB_SIZE;
+        if (sym->defined) {
+            target = section[sym->section] + sym->offset;
+        } else if (rel->data) {
+            error("undefined symbol: %s", sym->name);
+        } else if (!resolved[rel->sym]) {
+            void *addr = dlsym(RTLD_DEFAULT, sym->name);
+            if (!addr)
+                error("undefined function: %s", sym->name);
+            put_stub(target, addr);
+            resolved[rel->sym] = true;
+        }
+        int disp = target + rel->addend - (mem + rel->offset);
+        memcpy(mem + rel->offset, &disp, 4);
+    }
+    free(resolved);
+
+    if (mprotect(mem, code_size, PROT_READ | PROT_EXEC)
+        || (rodata_size && mprotect(mem + code_size, rodata_size, PROT_READ)))
+        error("cannot protect code: %s", strerror(errno));
+
+    int (*entry)() = NULL;
+    for (int i = 0; i < obj->nsym; i++)
+        if (obj->syms[i].defined && !strcmp(obj->syms[i].name, "main"))
+            entry = (int (*)())(mem + obj->syms[i].offset);
+    if (!entry)
+        error("undefined function: main");
+
+    // counters of instrumented program are written when compiler exits
+    if (opt_profile_generate) {
+        profile_counts = (long *)section[SC_BSS];
+        atexit(write_profile);
+    }
+
+    int ret = entry();
+    if (!opt_profile_generate)
+        munmap(mem, size);
+    return ret;
+}
@@ -0,0 +1,543 @@
+#include "9cc.h"
+
+// assignment "v = v + step" executed as statement in loop
+typedef struct Step Step;
+struct Step {
+    Node *stmt; // Assignment statement
+    Var *var; // Induction variable
+    int step; // Added constant
+};
+
+// variable keeping "iv * k" up to date with additive updates
+typedef struct Derived Derived;
+struct Derived {
+    Var *iv; // Induction variable
+    Node *k; // Invariant factor (number or variable)
+    Var *var; // Variable holding product
+};
+
+// invariant expression computed before loop
+typedef struct Hoisted Hoisted;
+struct Hoisted {
+    Node *expr; // Expression
+    unsigned hash; // Hash of expression
+    Var *var; // Variable holding value
+};
+
+// state of loop being optimized
+typedef struct Loop Loop;
+struct Loop {
+    int stamp; // Marks variables assigned in loop
+    bool clobber; // Memory may be written through pointers in loop
+    Step *steps;
+    int nstep;
+    Derived *derived;
+    int nderived;
+    Hoisted *hoisted;
+    int nhoisted;
+    int cap; // Capacity of arrays above
+};
+
+// state of function being optimized
+_Thread_local Function *loop_fn;
+_Thread_local bool loop_addr_taken;
+_Thread_local int loop_seq;
+_Thread_local int loop_temps;
+
+Node *loop_stmt(Node *node);
+Node *loop_list(Node *node);
+void scan_stmt(Node *node, Loop *lp);
+
+Node *var_node(Var *var) {
+    Node *node = new_node(ND_VAR);
+    node->var = var;
+    return node;
+}
+
+// new local variable of function holding loop value
+Var *new_temp() {
+    Var *var = arena_alloc(&parse_arena, sizeof(Var));
+    char name[16];
+    snprintf(name, sizeof(name), "loop.%d", loop_temps++);
+    var->name = arena_strndup(&parse_arena, name, strlen(name));
+    VarList *vl = arena_alloc(&parse_arena, sizeof(VarList));
+    vl->var = var;
+    vl->next = loop_fn->var_list;
+    loop_fn->var_list = vl;
+    return var;
+}
+
+// check whether tree contains "&"
+bool has_addr(Node *node) {
+    for (; node; node = node->next) {
+        if (node->pattern == ND_ADDR)
+            return true;
+        if (has_addr(node->lhs) || has_addr(node->rhs) || has_addr(node->cond)
+            || has_addr(node->then) || has_addr(node->els) || has_addr(node->init)
+            || has_addr(node->inc) || has_addr(node->stmts) || has_addr(node->args))
+            return true;
+    }
+    return false;
+}
+
+void grow_loop(Loop *lp) {
+    if (lp->nstep < lp->cap && lp->nderived < lp->cap && lp->nhoisted < lp->cap)
+        return;
+    lp->cap = lp->cap ? lp->cap * 2 : 16;
+    lp->steps = realloc(lp->steps, lp->cap * sizeof(Step));
+    lp->derived = realloc(lp->derived, lp->cap * sizeof(Derived));
+    lp->hoisted = realloc(lp->hoisted, lp->cap * sizeof(Hoisted));
+}
+
+// mark variable assigned in loop (adding step if iv)
+void mark_written(Var *var, Loop *lp, bool iv, int step) {
+    if (var->loop != lp->stamp) {
+        var->loop = lp->stamp;
+        var->not_iv = false;
+        var->step_min = var->step_max = step;
+    }
+    if (!iv)
+        var->not_iv = true;
+    if (step < var->step_min)
+        var->step_min = step;
+    if (step > var->step_max)
+        var->step_max = step;
+}
+
+// find assignments and stores in expression
+void scan_expr(Node *node, Loop *lp) {
+    if (!node)
+        return;
+    switch (node->pattern) {
+    case ND_ASSIGN:
+        if (node->lhs->pattern == ND_VAR) {
+            mark_written(node->lhs->var, lp, false, 0);
+        } else {
+            lp->clobber = true;
+            scan_expr(node->lhs, lp);
+        }
+        scan_expr(node->rhs, lp);
+        return;
+    case ND_FUNCALL:
+        // callee reaches locals only through pointers
+        if (loop_addr_taken)
+            lp->clobber = true;
+        for (Node *arg = node->args; arg; arg = arg->next)
+            scan_expr(arg, lp);
+        return;
+    case ND_INLINE:
+        for (Node *n = node->stmts; n; n = n->next)
+            scan_stmt(n, lp);
+        scan_expr(node->lhs, lp);
+        return;
+    }
+    scan_expr(node->lhs, lp);
+    scan_expr(node->rhs, lp);
+}
+
+// constant added by "v = v + c", "v = c + v" or "v = v - c" (false if other)
+bool step_of(Node *node, int *step) {
+    if (node->pattern != ND_ASSIGN || node->lhs->pattern != ND_VAR)
+        return false;
+    Var *var = node->lhs->var;
+    Node *rhs = node->rhs;
+    if (rhs->pattern != ND_ADD && rhs->pattern != ND_SUB)
+        return false;
+    if (rhs->lhs->pattern == ND_VAR && rhs->lhs->var == var && rhs->rhs->pattern == ND_NUM
+        && rhs->rhs->val != -2147483648) {
+        *step = rhs->pattern == ND_ADD ? rhs->rhs->val : -rhs->rhs->val;
+        return true;
+    }
+    if (rhs->pattern == ND_ADD && rhs->rhs->pattern == ND_VAR && rhs->rhs->var == var
+        && rhs->lhs->pattern == ND_NUM) {
+        *step = rhs->lhs->val;
+        return true;
+    }
+    return false;
+}
+
+// find assignments, stores and induction steps in statement
+void scan_stmt(Node *node, Loop *lp) {
+    if (!node)
+        return;
+    int step;
+    switch (node->pattern) {
+    case ND_IF:
+        scan_expr(node->cond, lp);
+        scan_stmt(node->then, lp);
+        scan_stmt(node->els, lp);
+        return;
+    case ND_WHILE:
+    case ND_FOR:
+        scan_expr(node->init, lp);
+        scan_expr(node->cond, lp);
+        scan_stmt(node->then, lp);
+        scan_expr(node->inc, lp);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->stmts; n; n = n->next)
+            scan_stmt(n, lp);
+        return;
+    case ND_RETURN:
+        scan_expr(node->lhs, lp);
+        return;
+    }
+
+    if (step_of(node, &step)) {
+        grow_loop(lp);
+        lp->steps[lp->nstep++] = (Step){node, node->lhs->var, step};
+        mark_written(node->lhs->var, lp, true, step);
+        return;
+    }
+    scan_expr(node, lp);
+}
+
+bool is_invariant(Node *node, Loop *lp) {
+    switch (node->pattern) {
+    case ND_NUM:
+        return true;
+    case ND_VAR:
+        return node->var->loop != lp->stamp && !lp->clobber;
+    case ND_ADDR:
+        return node->lhs->pattern == ND_VAR || is_invariant(node->lhs->lhs, lp);
+    case ND_NEG:
+        return is_invariant(node->lhs, lp);
+    case ND_DIV:
+        // never trap on path which did not divide
+        if (node->rhs->pattern != ND_NUM || node->rhs->val == 0 || node->rhs->val == -1)
+            return false;
+        return is_invariant(node->lhs, lp);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return is_invariant(node->lhs, lp) && is_invariant(node->rhs, lp);
+    }
+    return false;
+}
+
+// variable whose every assignment in loop adds constant
+bool is_iv(Node *node, Loop *lp) {
+    return node->pattern == ND_VAR && node->var->loop == lp->stamp && !node->var->not_iv
+        && !lp->clobber;
+}
+
+// replace "iv * k" by variable updated with iv
+Node *reduce_expr(Node *node, Loop *lp) {
+    if (node->pattern != ND_MUL)
+        return node;
+    Node *iv = node->lhs, *k = node->rhs;
+    if (!is_iv(iv, lp)) {
+        iv = node->rhs;
+        k = node->lhs;
+    }
+    if (!is_iv(iv, lp))
+        return node;
+
+    // factor must make constant increments (steps of 0 make none)
+    long val;
+    if (k->pattern == ND_NUM) {
+        if (!eval_binary(ND_MUL, iv->var->step_min, k->val, &val)
+            || !eval_binary(ND_MUL, iv->var->step_max, k->val, &val))
+            return node;
+    } else if (k->pattern != ND_VAR || !is_invariant(k, lp)
+               || iv->var->step_min < -1 || iv->var->step_max > 1) {
+        return node;
+    }
+
+    for (int i = 0; i < lp->nderived; i++) {
+        Derived *d = &lp->derived[i];
+        if (d->iv == iv->var && d->k->pattern == k->pattern
+            && (k->pattern == ND_NUM ? d->k->val == k->val : d->k->var == k->var))
+            return var_node(d->var);
+    }
+
+    grow_loop(lp);
+    Var *var = new_temp();
+    mark_written(var, lp, false, 0);
+    lp->derived[lp->nderived++] = (Derived){iv->var, k, var};
+    return var_node(var);
+}
+
+unsigned hash_expr(Node *node) {
+    unsigned h = node->pattern * 31 + node->val;
+    if (node->pattern == ND_VAR)
+        return h ^ (unsigned)(unsigned long)node->var;
+    if (node->lhs)
+        h = h * 16777619u ^ hash_expr(node->lhs);
+    if (node->rhs)
+        h = h * 16777619u ^ hash_expr(node->rhs);
+    return h;
+}
+
+bool same_expr(Node *a, Node *b) {
+    if (!a || !b)
+        return a == b;
+    return a->pattern == b->pattern && a->val == b->val && a->var == b->var
+        && same_expr(a->lhs, b->lhs) && same_expr(a->rhs, b->rhs);
+}
+
+// check whether computing expression once saves work ("&x+8" becomes
+// frame offset anyway)
+bool worth_hoisting(Node *node) {
+    switch (node->pattern) {
+    case ND_NUM:
+    case ND_VAR:
+    case ND_ADDR:
+        return false;
+    case ND_ADD:
+    case ND_SUB:
+        return node->lhs->pattern != ND_ADDR || node->rhs->pattern != ND_NUM;
+    }
+    return true;
+}
+
+// replace invariant expression by variable computed before loop
+Node *hoist_expr(Node *node, Loop *lp) {
+    if (!worth_hoisting(node) || !is_invariant(node, lp))
+        return node;
+
+    unsigned hash = hash_expr(node);
+    for (int i = 0; i < lp->nhoisted; i++)
+        if (lp->hoisted[i].hash == hash && same_expr(lp->hoisted[i].expr, node))
+            return var_node(lp->hoisted[i].var);
+
+    grow_loop(lp);
+    Var *var = new_temp();
+    lp->hoisted[lp->nhoisted++] = (Hoisted){node, hash, var};
+    return var_node(var);
+}
+
+// apply rewrite to subexpressions of expression
+void rewrite_operands(Node *node, Loop *lp, Node *(*rewrite)(Node *, Loop *));
+void rewrite_stmt(Node *node, Loop *lp, Node *(*rewrite)(Node *, Loop *));
+
+Node *rewrite_expr(Node *node, Loop *lp, Node *(*rewrite)(Node *, Loop *)) {
+    if (!node)
+        return NULL;
+    Node *new = rewrite(node, lp);
+    if (new != node)
+        return new;
+    rewrite_operands(node, lp, rewrite);
+    return node;
+}
+
+void rewrite_operands(Node *node, Loop *lp, Node *(*rewrite)(Node *, Loop *)) {
+    switch (node->pattern) {
+    case ND_ASSIGN:
+        // variable stored to stays
+        if (node->lhs->pattern == ND_DEREF)
+            node->lhs->lhs = rewrite_expr(node->lhs->lhs, lp, rewrite);
+        node->rhs = rewrite_expr(node->rhs, lp, rewrite);
+        return;
+    case ND_ADDR:
+        if (node->lhs->pattern == ND_DEREF)
+            node->lhs->lhs = rewrite_expr(node->lhs->lhs, lp, rewrite);
+        return;
+    case ND_FUNCALL: {
+        Node head = {};
+        Node *cur = &head;
+        for (Node *arg = node->args; arg; ) {
+            Node *next = arg->next;
+            cur = cur->next = rewrite_expr(arg, lp, rewrite);
+            cur->next = NULL;
+            arg = next;
+        }
+        node->args = head.next;
+        return;
+    }
+    case ND_INLINE:
+        for (Node *n = node->stmts; n; n = n->next)
+            rewrite_stmt(n, lp, rewrite);
+        node->lhs = rewrite_expr(node->lhs, lp, rewrite);
+        return;
+    }
+    node->lhs = rewrite_expr(node->lhs, lp, rewrite);
+    node->rhs = rewrite_expr(node->rhs, lp, rewrite);
+}
+
+// apply rewrite to expressions of statement
+void rewrite_stmt(Node *node, Loop *lp, Node *(*rewrite)(Node *, Loop *)) {
+    if (!node)
+        return;
+    switch (node->pattern) {
+    case ND_IF:
+        node->cond = rewrite_expr(node->cond, lp, rewrite);
+        rewrite_stmt(node->then, lp, rewrite);
+        rewrite_stmt(node->els, lp, rewrite);
+        return;
+    case ND_WHILE:
+    case ND_FOR:
+        node->init = rewrite_expr(node->init, lp, rewrite);
+        node->cond = rewrite_expr(node->cond, lp, rewrite);
+        rewrite_stmt(node->then, lp, rewrite);
+        node->inc = rewrite_expr(node->inc, lp, rewrite);
+        return;
+    case ND_BLOCK:
+        for (Node *n = node->stmts; n; n = n->next)
+            rewrite_stmt(n, lp, rewrite);
+        return;
+    case ND_RETURN:
+        node->lhs = rewrite_expr(node->lhs, lp, rewrite);
+        return;
+    }
+
+    // expression statement keeps its node
+    rewrite_operands(node, lp, rewrite);
+}
+
+// turn statement into block of itself followed by statement
+void append_stmt(Node *node, Node *after) {
+    Node *first = new_node(node->pattern);
+    Node *next = node->next;
+    *first = *node;
+    first->next = after;
+    after->next = NULL;
+    *node = (Node){ND_BLOCK};
+    node->stmts = first;
+    node->next = next;
+}
+
+Node *new_assign(Var *var, Node *rhs) {
+    return new_binary(ND_ASSIGN, var_node(var), rhs);
+}
+
+// optimize loop whose inner loops are done and return replacement
+Node *optimize_loop(Node *node) {
+    // increment is last statement of body (there is no continue)
+    if (node->inc) {
+        Node *body = new_node(ND_BLOCK);
+        body->stmts = node->then;
+        node->then->next = node->inc;
+        node->inc = NULL;
+        node->then = body;
+    }
+
+    Loop lp = {++loop_seq};
+    scan_expr(node->cond, &lp);
+    scan_stmt(node->then, &lp);
+
+    // strength reduction
+    node->cond = rewrite_expr(node->cond, &lp, reduce_expr);
+    rewrite_stmt(node->then, &lp, reduce_expr);
+    for (int i = 0; i < lp.nstep; i++) {
+        Step *st = &lp.steps[i];
+        for (int j = 0; j < lp.nderived; j++) {
+            Derived *d = &lp.derived[j];
+            if (d->iv != st->var || !st->step)
+                continue;
+            Node *inc;
+            if (d->k->pattern == ND_NUM)
+                inc = new_binary(ND_ADD, var_node(d->var), new_val_node(st->step * d->k->val));
+            else
+                inc = new_binary(st->step > 0 ? ND_ADD : ND_SUB, var_node(d->var), var_node(d->k->var));
+            append_stmt(st->stmt, new_assign(d->var, inc));
+        }
+    }
+
+    // invariant code motion
+    node->cond = rewrite_expr(node->cond, &lp, hoist_expr);
+    rewrite_stmt(node->then, &lp, hoist_expr);
+
+    if (!lp.nderived && !lp.nhoisted) {
+        free(lp.steps);
+        free(lp.derived);
+        free(lp.hoisted);
+        return node;
+    }
+
+    // preheader computes hoisted values and products after initializer
+    Node head = {};
+    Node *cur = &head;
+    if (node->init) {
+        cur = cur->next = node->init;
+        node->init = NULL;
+    }
+    for (int i = 0; i < lp.nhoisted; i++)
+        cur = cur->next = new_assign(lp.hoisted[i].var, lp.hoisted[i].expr);
+    for (int i = 0; i < lp.nderived; i++) {
+        Derived *d = &lp.derived[i];
+        Node *k = d->k->pattern == ND_NUM ? new_val_node(d->k->val) : var_node(d->k->var);
+        cur = cur->next = new_assign(d->var, new_binary(ND_MUL, var_node(d->iv), k));
+    }
+    cur->next = node;
+    Node *next = node->next;
+    node->next = NULL;
+
+    Node *block = new_node(ND_BLOCK);
+    block->stmts = head.next;
+    block->next = next;
+    free(lp.steps);
+    free(lp.derived);
+    free(lp.hoisted);
+    return block;
+}
+
+// optimize loops in statement list
+Node *loop_list(Node *node) {
+    Node head;
+    head.next = NULL;
+    Node *cur = &head;
+
+    for (Node *n = node; n; ) {
+        Node *next = n->next;
+        n->next = NULL;
+        cur->next = loop_stmt(n);
+        cur = cur->next;
+        n = next;
+    }
+    return head.next;
+}
+
+// optimize loops in bodies of inlined functions within expression
+void loop_expr(Node *node) {
+    if (!node)
+        return;
+    if (node->pattern == ND_INLINE)
+        node->stmts = loop_list(node->stmts);
+    loop_expr(node->lhs);
+    loop_expr(node->rhs);
+    for (Node *arg = node->args; arg; arg = arg->next)
+        loop_expr(arg);
+}
+
+// optimize loops in statement (inner loops first) and return replacement
+Node *loop_stmt(Node *node) {
+    loop_expr(node->cond);
+    loop_expr(node->init);
+    loop_expr(node->inc);
+    switch (node->pattern) {
+    case ND_IF:
+        node->then = loop_stmt(node->then);
+        if (node->els)
+            node->els = loop_stmt(node->els);
+        return node;
+    case ND_WHILE:
+    case ND_FOR:
+        node->then = loop_stmt(node->then);
+        // preheader of loop whose body never runs in profile is wasted work
+        if (!edge_count(node, 0))
+            return node;
+        return optimize_loop(node);
+    case ND_BLOCK:
+        node->stmts = loop_list(node->stmts);
+        return node;
+    }
+    loop_expr(node);
+    return node;
+}
+
+// hoist invariant expressions out of loops and reduce induction products
+void optimize_loops(Function *program) {
+    for (Function *fn = program; fn; fn = fn->next) {
+        if (fn->cached.data)
+            continue;
+        loop_fn = fn;
+        loop_addr_taken = has_addr(fn->node);
+        loop_temps = 0;
+        fn->node = loop_list(fn->node);
+    }
+}
@@ -1,17 +1,301 @@
 #include "9cc.h"
 
+bool opt_fold = true;
+bool opt_peephole = true;
+char *opt_output;
+_Thread_local bool opt_obj;
+bool opt_run;
+int opt_jobs;
+char *opt_cache_dir;
+long opt_cache_size = 256 << 20;
+bool opt_cache_stats;
+bool opt_mem_report;
+bool opt_time_report;
+bool opt_time_report_json;
+bool opt_simd = true;
+bool opt_ir_opt = true;
+bool opt_loop_opt = true;
+bool opt_inline = true;
+int opt_inline_limit = 40;
+bool opt_tail_calls = true;
+bool opt_stack_reuse = true;
+bool opt_leaf_opt = true;
+bool opt_mem2reg = true;
+char *opt_profile_generate;
+char *opt_profile_use;
+bool opt_dump_ir;
+bool opt_server;
+
+void usage() {
+    error("usage: 9cc [-c] [-o file] [--run] [--lib file.so] [-j threads]"
+          " [--cache-dir dir] [--cache-size bytes] [--cache-stats]"
+          " [-fno-fold] [-fno-peephole] [-fno-simd] [-fmem-report]"
+          " [-ftime-report[=json]]"
+          " [-fno-ir-opt] [-fno-loop-opt] [-fno-inline] [-finline-limit=nodes]"
+          " [-fno-tail-calls] [-fno-stack-reuse] [-fno-leaf-opt]"
+          " [-fno-mem2reg] [-fprofile-generate=file] [-fprofile-use=file]"
+          " [-fdump-ir] (<file> | -e <program>)\n"
+          "       9cc --server <socket> [-j threads] [--cache-dir dir] [--cache-size bytes]"
+          " [-fno-fold] [-fno-peephole] [-fno-simd] [-fno-ir-opt] [-fno-loop-opt]"
+          " [-fno-inline] [-finline-limit=nodes] [-fno-tail-calls] [-fno-stack-reuse]"
+          " [-fno-leaf-opt] [-fno-mem2reg]\n"
+          "       9cc --client <socket> [-c] [-o file] (<file> | -e <program>)");
+}
+
+// free memory of front end and forget identifiers
+void compile_reset() {
+    arena_free(&lex_arena);
+    arena_free(&parse_arena);
+    arena_free(&codegen_arena);
+    intern_reset();
+}
+
+// compile source set by read_source or set_source into buffer and return
+// exit status
+int compile(Buffer *out) {
+    // tokenize and parse
+    phase_begin(PH_TOKENIZE);
+    tokenizer();
+    phase_end(PH_TOKENIZE);
+    phase_begin(PH_PARSE);
+    Function *prog = program();
+    phase_end(PH_PARSE);
+
+    // counters are numbered on tree as written
+    if (opt_profile_generate || opt_profile_use)
+        attach_profile(prog);
+
+    // tokens are not referred after parsing
+    if (opt_mem_report)
+        arena_report(&lex_arena);
+    arena_free(&lex_arena);
+
+    // optimize
+    phase_begin(PH_FOLD);
+    if (opt_fold)
+        fold_program(prog);
+    phase_end(PH_FOLD);
+
+    phase_begin(PH_INLINE);
+    if (opt_inline)
+        inline_functions(prog);
+    phase_end(PH_INLINE);
+    phase_begin(PH_LOOP);
+    if (opt_loop_opt)
+        optimize_loops(prog);
+    phase_end(PH_LOOP);
+
+    // build assembly or object
+    phase_begin(PH_BUILD);
+    int status = build(prog, out);
+    phase_end(PH_BUILD);
+
+    if (opt_mem_report) {
+        arena_report(&parse_arena);
+        arena_report(&codegen_arena);
+    }
+    compile_reset();
+    return status;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 2) {
+    // parse options
+    char *source = NULL;
+    char *path = NULL;
+    char *server = NULL;
+    char *client_socket = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-fno-fold")) {
+            opt_fold = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-o")) {
+            if (++i == argc)
+                usage();
+            opt_output = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-c")) {
+            opt_obj = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--run")) {
+            opt_run = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--lib")) {
+            if (++i == argc)
+                usage();
+            jit_load(argv[i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "-j")) {
+            if (++i == argc)
+                usage();
+            opt_jobs = atoi(argv[i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "--cache-dir")) {
+            if (++i == argc)
+                usage();
+            opt_cache_dir = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--cache-size")) {
+            if (++i == argc)
+                usage();
+            opt_cache_size = atol(argv[i]);
+            continue;
+        }
+        if (!strcmp(argv[i], "--cache-stats")) {
+            opt_cache_stats = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-e")) {
+            if (++i == argc || source || path)
+                usage();
+            source = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-simd")) {
+            opt_simd = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fmem-report")) {
+            opt_mem_report = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-ftime-report")) {
+            opt_time_report = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-ftime-report=json")) {
+            opt_time_report = opt_time_report_json = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-peephole")) {
+            opt_peephole = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-ir-opt")) {
+            opt_ir_opt = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-loop-opt")) {
+            opt_loop_opt = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-inline")) {
+            opt_inline = false;
+            continue;
+        }
+        if (!strncmp(argv[i], "-finline-limit=", 15)) {
+            opt_inline_limit = atoi(argv[i] + 15);
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-tail-calls")) {
+            opt_tail_calls = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-stack-reuse")) {
+            opt_stack_reuse = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-leaf-opt")) {
+            opt_leaf_opt = false;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fno-mem2reg")) {
+            opt_mem2reg = false;
+            continue;
+        }
+        if (!strncmp(argv[i], "-fprofile-generate=", 19)) {
+            opt_profile_generate = argv[i] + 19;
+            continue;
+        }
+        if (!strncmp(argv[i], "-fprofile-use=", 14)) {
+            opt_profile_use = argv[i] + 14;
+            continue;
+        }
+        if (!strcmp(argv[i], "-fdump-ir")) {
+            opt_dump_ir = true;
+            continue;
+        }
+        if (!strcmp(argv[i], "--server")) {
+            if (++i == argc)
+                usage();
+            server = argv[i];
+            continue;
+        }
+        if (!strcmp(argv[i], "--client")) {
+            if (++i == argc)
+                usage();
+            client_socket = argv[i];
+            continue;
+        }
+        if (argv[i][0] == '-' && argv[i][1])
+            usage();
+        if (source || path)
+            usage();
+        path = argv[i];
+    }
+    // server compiles sources sent by clients until killed
+    if (server) {
+        if (source || path || client_socket || opt_output || opt_obj || opt_run
+            || opt_dump_ir || opt_time_report || opt_mem_report || opt_cache_stats
+            || opt_profile_generate || opt_profile_use)
+            usage();
+        opt_server = true;
+        init_scanner(opt_simd);
+        if (opt_cache_dir)
+            init_cache();
+        serve(server);
+        return 0;
+    }
+
+    if (!source && !path) {
         fprintf(stderr, "invalid number of arguments");
         return 1;
     }
 
-    // tokenize and parse
-    user_input = argv[1];
-    current_token = tokenizer();
+    if (path)
+        read_source(path);
+    else
+        set_source(source);
+
+    // server compiles with options it was started with, so client takes
+    // no others
+    if (client_socket) {
+        for (int i = 1; i < argc; i++) {
+            if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "-e") || !strcmp(argv[i], "--client"))
+                i++;
+            else if (argv[i][0] == '-' && argv[i][1] && strcmp(argv[i], "-c"))
+                usage();
+        }
+        return client(client_socket);
+    }
+
+    // cached functions would not count
+    if (opt_profile_generate && (opt_cache_dir || opt_profile_use))
+        usage();
+    if (opt_profile_use)
+        read_profile(opt_profile_use);
+
+    if (opt_cache_dir)
+        init_cache();
+    init_scanner(opt_simd);
 
-    // build assembly
-    build(program());
+    Buffer out = {};
+    int status = compile(&out);
+    if (!opt_run)
+        write_output(&out, opt_output);
+    free(out.data);
 
-    return 0;
-}
\ No newline at end of file
+    if (opt_cache_dir)
+        cache_evict();
+    if (opt_cache_stats)
+        cache_report();
+    if (opt_time_report)
+        time_report();
+    return status;
+}
@@ -0,0 +1,78 @@
+#include "9cc.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+// reserve space for len more bytes
+void buf_reserve(Buffer *buf, int len) {
+    if (buf->len + len <= buf->cap)
+        return;
+    int cap = buf->cap ? buf->cap : 4096;
+    while (cap < buf->len + len)
+        cap *= 2;
+    buf->data = realloc(buf->data, cap);
+    if (!buf->data)
+        error("out of memory");
+    buf->cap = cap;
+}
+
+void buf_write(Buffer *buf, char *s, int len) {
+    buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, s, len);
+    buf->len += len;
+}
+
+void buf_str(Buffer *buf, char *s) {
+    buf_write(buf, s, strlen(s));
+}
+
+void buf_char(Buffer *buf, char c) {
+    buf_reserve(buf, 1);
+    buf->data[buf->len++] = c;
+}
+
+// write decimal integer
+void buf_int(Buffer *buf, long val) {
+    char tmp[24];
+    int i = sizeof(tmp);
+    unsigned long u = val < 0 ? -(unsigned long)val : val;
+
+    do {
+        tmp[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (val < 0)
+        tmp[--i] = '-';
+    buf_write(buf, tmp + i, sizeof(tmp) - i);
+}
+
+// write local label name ".L<fn>.<label>" (labels are numbered per function)
+void buf_label(Buffer *buf, char *fn, int label) {
+    buf_write(buf, ".L", 2);
+    buf_str(buf, fn);
+    buf_char(buf, '.');
+    buf_int(buf, label);
+}
+
+// write buffer to file (stdout if path is NULL) at once
+void write_output(Buffer *buf, char *path) {
+    if (!path) {
+        if (fwrite(buf->data, 1, buf->len, stdout) != buf->len)
+            error("cannot write output");
+        fflush(stdout);
+        return;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        error("cannot open %s: %s", path, strerror(errno));
+    for (int off = 0; off < buf->len; ) {
+        int n = write(fd, buf->data + off, buf->len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("cannot write %s: %s", path, strerror(errno));
+        }
+        off += n;
+    }
+    close(fd);
+}
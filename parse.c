@@ -1,10 +1,12 @@
 #include "9cc.h"
 
-VarList *var_list;
+_Thread_local VarList *var_list;
+_Thread_local Scope *scope;
 
 Node *new_node(NodePattern pattern) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&parse_arena, sizeof(Node));
     node->pattern = pattern;
+    node_count[pattern]++;
     return node;
 }
 
@@ -28,7 +30,7 @@ Node *new_var_node(Var *Var) {
 }
 
 Function *new_fn(char *fn_name, Node *node, VarList *params, VarList *var_list) {
-    Function *fn = calloc(1, sizeof(Function));
+    Function *fn = arena_alloc(&parse_arena, sizeof(Function));
     fn->name = fn_name;
     fn->node = node;
     fn->params = params;
@@ -38,41 +40,37 @@ Function *new_fn(char *fn_name, Node *node, VarList *params, VarList *var_list)
 
 // append var to var_list
 void *append_var(Var *var) {
-    VarList *vl = calloc(1, sizeof(VarList));
+    VarList *vl = arena_alloc(&parse_arena, sizeof(VarList));
     vl->var = var;
     vl->next = var_list;
     var_list = vl;
 }
 
 // get new var
-Var *new_var(char *name) {
-    Var *var = calloc(1, sizeof(Var));
-    var->name = name;
+Var *new_var(int id) {
+    Var *var = arena_alloc(&parse_arena, sizeof(Var));
+    var->name = intern_name(id);
+    var_count++;
     append_var(var);
+    scope_add(scope, id, var);
     return var;
 }
 
 Var *find_var(Token *token) {
-    for (VarList *vl = var_list; vl; vl = vl->next) {
-        Var *var = vl->var;
-        if (strlen(var->name) == token->len
-            && !memcmp(token->str, var->name, token->len))
-            return var;
-    }
-    return NULL;
+    return scope_find(scope, token->val);
 }
 
 VarList *read_fn_param() {
     // no param
-    if (read_next_token(")"))
+    if (read_next_token(PN_RPAREN))
         return NULL;
     
-    VarList *head = calloc(1, sizeof(VarList));
+    VarList *head = arena_alloc(&parse_arena, sizeof(VarList));
     head->var = new_var(get_ident());
     VarList *cur = head;
-    while (!read_next_token(")")) {
-        expect(",");
-        cur->next = calloc(1, sizeof(VarList));
+    while (!read_next_token(PN_RPAREN)) {
+        expect(PN_COMMA);
+        cur->next = arena_alloc(&parse_arena, sizeof(VarList));
         cur->next->var = new_var(get_ident());
         cur = cur->next;
     }
@@ -96,9 +94,13 @@ Function *program() {
     head.next = NULL;
     Function *cur = &head;
 
-    while (!at_eof()) {
-        cur->next = function();
+    // unchanged function is taken from cache without parsing
+    if (opt_cache_dir)
+        cache_scan();
+    for (int i = 0; !at_eof(); i++) {
+        cur->next = opt_cache_dir ? cache_function(i) : function();
         cur = cur->next;
+        fn_count++;
     }
     return head.next;
 }
@@ -107,17 +109,18 @@ Function *program() {
 // params = ident ("," ident)*
 Function *function() {
     var_list = NULL;
-    char *ident = get_ident();
-    expect("(");
+    scope = new_scope();
+    char *ident = intern_name(get_ident());
+    expect(PN_LPAREN);
     VarList *params = read_fn_param();
 
-    expect("{");
+    expect(PN_LBRACE);
 
     Node head;
     head.next = NULL;
     Node *cur = &head;
 
-    while (!read_next_token("}")) {
+    while (!read_next_token(PN_RBRACE)) {
         cur->next = stmt();
         cur = cur->next;
     }
@@ -136,55 +139,55 @@ Node *stmt() {
     Node *node;
 
     // return statement
-    if (read_next_token("return")) {
+    if (read_next_token(PN_RETURN)) {
         node = new_binary(ND_RETURN, expr(), NULL);
-        expect(";");
+        expect(PN_SEMICOLON);
         return node;
     }
 
     // if-else statement
-    if (read_next_token("if")) {
+    if (read_next_token(PN_IF)) {
         Node *node = new_node(ND_IF);
-        expect("(");
+        expect(PN_LPAREN);
         node->cond = expr();
-        expect(")");
+        expect(PN_RPAREN);
         node->then = stmt();
-        if (read_next_token("else"))
+        if (read_next_token(PN_ELSE))
             node->els = stmt();
         return node;
     }
 
     // while statement
-    if (read_next_token("while")) {
+    if (read_next_token(PN_WHILE)) {
         Node *node = new_node(ND_WHILE);
-        expect("(");
+        expect(PN_LPAREN);
         node->cond = expr();
-        expect(")");
+        expect(PN_RPAREN);
         node->then = stmt();
         return node;
     }
 
     // for statement
-    if (read_next_token("for")) {
+    if (read_next_token(PN_FOR)) {
         Node *node = new_node(ND_FOR);
-        expect("(");
+        expect(PN_LPAREN);
 
         // if initialize statement exists
-        if (!read_next_token(";")) {
+        if (!read_next_token(PN_SEMICOLON)) {
             node->init = expr();
-            expect(";");
+            expect(PN_SEMICOLON);
         }
 
         // if conditional statement exists
-        if (!read_next_token(";")) {
+        if (!read_next_token(PN_SEMICOLON)) {
             node->cond = expr();
-            expect(";");
+            expect(PN_SEMICOLON);
         }
 
         // if increment statement exists
-        if (!read_next_token(")")) {
+        if (!read_next_token(PN_RPAREN)) {
             node->inc = expr();
-            expect(")");
+            expect(PN_RPAREN);
         }
 
         node->then = stmt();
@@ -192,12 +195,12 @@ Node *stmt() {
     }
 
     // block
-    if (read_next_token("{")) {
+    if (read_next_token(PN_LBRACE)) {
         Node head;
         head.next = NULL;
         Node *cur = &head;
 
-        while (!read_next_token("}")) {
+        while (!read_next_token(PN_RBRACE)) {
             cur->next = stmt();
             cur = cur->next;
         }
@@ -208,7 +211,7 @@ Node *stmt() {
     }
 
     node = expr();
-    expect(";");
+    expect(PN_SEMICOLON);
     return node;
 }
 
@@ -220,7 +223,7 @@ Node *expr() {
 // assign = equarity ("=" assign)?
 Node *assign() {
     Node *node = equality();
-    if (read_next_token("="))
+    if (read_next_token(PN_ASSIGN))
         return new_binary(ND_ASSIGN, node, assign());
     return node;
 }
@@ -230,9 +233,9 @@ Node *equality() {
     Node *node = relational();
 
     while (1) {
-        if (read_next_token("=="))
+        if (read_next_token(PN_EQ))
             node = new_binary(ND_EQ, node, relational());
-        else if (read_next_token("!="))
+        else if (read_next_token(PN_NE))
             node = new_binary(ND_NE, node, relational());
         else
             return node;
@@ -244,13 +247,13 @@ Node *relational() {
     Node *node = add();
 
     while (1) {
-        if (read_next_token("<"))
+        if (read_next_token(PN_LT))
             node = new_binary(ND_LT, node, add());
-        else if (read_next_token("<="))
+        else if (read_next_token(PN_LE))
             node = new_binary(ND_LE, node, add());
-        else if (read_next_token(">"))
+        else if (read_next_token(PN_GT))
             node = new_binary(ND_LT, add(), node);
-        else if (read_next_token(">="))
+        else if (read_next_token(PN_GE))
             node = new_binary(ND_LE, add(), node);
         else
             return node;
@@ -262,9 +265,9 @@ Node *add() {
     Node *node = mul();
 
     while (1) {
-        if (read_next_token("+"))
+        if (read_next_token(PN_ADD))
             node = new_binary(ND_ADD, node, mul());
-        else if (read_next_token("-"))
+        else if (read_next_token(PN_SUB))
             node = new_binary(ND_SUB, node, mul());
         else
             return node;
@@ -276,9 +279,9 @@ Node *mul() {
     Node *node = unary();
     
     while (1) {
-        if (read_next_token("*"))
+        if (read_next_token(PN_MUL))
             node = new_binary(ND_MUL, node, unary());
-        else if (read_next_token("/"))
+        else if (read_next_token(PN_DIV))
             node = new_binary(ND_DIV, node, unary());
         else
             return node;
@@ -288,13 +291,13 @@ Node *mul() {
 // unary = ("+" | "-" | "&" | "*")? unary
 //       | primary
 Node *unary() {
-    if (read_next_token("+"))
+    if (read_next_token(PN_ADD))
         return unary();
-    if (read_next_token("-"))
+    if (read_next_token(PN_SUB))
         return new_binary(ND_SUB, new_val_node(0), unary());
-    if (read_next_token("&"))
+    if (read_next_token(PN_AMP))
         return new_binary(ND_ADDR, unary(), NULL);
-    if (read_next_token("*"))
+    if (read_next_token(PN_MUL))
         return new_binary(ND_DEREF, unary(), NULL);
     return primary();
 }
@@ -302,18 +305,18 @@ Node *unary() {
 // args = "(" (assign ("," assign)*)? ")"
 Node *args() {
     // no args
-    if (read_next_token(")"))
+    if (read_next_token(PN_RPAREN))
         return NULL;
     
     // parse args
     Node *head = assign();
     Node *cur = head;
-    while (read_next_token(",")) {
+    while (read_next_token(PN_COMMA)) {
         cur->next = assign();
         cur = cur->next;
     }
 
-    expect(")");
+    expect(PN_RPAREN);
     return head;
 }
 
@@ -322,9 +325,9 @@ Node *args() {
 //         | num
 Node *primary() {
     // "(" expr ")"
-    if (read_next_token("(")) {
+    if (read_next_token(PN_LPAREN)) {
         Node *node = expr();
-        expect(")");
+        expect(PN_RPAREN);
         return node;
     }
 
@@ -332,9 +335,9 @@ Node *primary() {
     Token *ident_token = read_next_ident();
     if (ident_token) {
         // function
-        if (read_next_token("(")) {
+        if (read_next_token(PN_LPAREN)) {
             Node *node = new_node(ND_FUNCALL);
-            node->fn_name = strndup(ident_token->str, ident_token->len);
+            node->fn_name = intern_name(ident_token->val);
             node->args = args();
             return node;
         }
@@ -342,8 +345,7 @@ Node *primary() {
         // variable
         Var *var = find_var(ident_token);
         if (!var) { // not exist
-            char *ident = strndup(ident_token->str, ident_token->len);
-            var = new_var(ident);
+            var = new_var(ident_token->val);
             return new_var_node(var);
         }
         return new_var_node(var);
@@ -0,0 +1,425 @@
+#include "9cc.h"
+
+bool same_operand(Operand a, Operand b) {
+    return a.pattern == b.pattern && a.reg == b.reg && a.val == b.val;
+}
+
+CondCode invert_cc(CondCode cc) {
+    static CondCode inv[] = {
+        [CC_E] = CC_NE, [CC_NE] = CC_E,
+        [CC_L] = CC_GE, [CC_GE] = CC_L,
+        [CC_LE] = CC_G, [CC_G] = CC_LE,
+    };
+    return inv[cc];
+}
+
+// instruction which only writes its destination register
+bool is_pure(Inst *in) {
+    if (in->dst.pattern != OP_VREG && in->dst.pattern != OP_REG)
+        return false;
+    switch (in->pattern) {
+    case IN_MOV:
+    case IN_LEA:
+    case IN_ADD:
+    case IN_SUB:
+    case IN_IMUL:
+    case IN_NEG:
+    case IN_SHL:
+    case IN_SAR:
+    case IN_SHR:
+    case IN_SETCC:
+    case IN_MOVZB:
+        return true;
+    }
+    return false;
+}
+
+// count uses of each virtual register
+int *count_uses(Inst *insts, int nvreg) {
+    int *uses = calloc(nvreg + 1, sizeof(int));
+    int use[3], def[1], nuse, ndef;
+    for (Inst *in = insts; in; in = in->next) {
+        inst_vregs(in, use, &nuse, def, &ndef);
+        for (int i = 0; i < nuse; i++)
+            uses[use[i]]++;
+    }
+    return uses;
+}
+
+// replace memory operands based on "lea v, [rbp+d]" by "[rbp+d]"
+void fold_frame_address(Inst *insts, int nvreg) {
+    // register is known if stamped with current block
+    int *known = calloc(nvreg + 1, sizeof(int));
+    long *disp = calloc(nvreg + 1, sizeof(long));
+    int block = 1;
+    int use[3], def[1], nuse, ndef;
+
+    for (Inst *in = insts; in; in = in->next) {
+        // other paths may reach label
+        if (in->pattern == IN_LABEL) {
+            block++;
+            continue;
+        }
+
+        if (in->src.pattern == OP_VMEM && known[in->src.reg] == block)
+            in->src = (Operand){OP_MEM, RBP, disp[in->src.reg] + in->src.val};
+        if (in->dst.pattern == OP_VMEM && known[in->dst.reg] == block)
+            in->dst = (Operand){OP_MEM, RBP, disp[in->dst.reg] + in->dst.val};
+
+        inst_vregs(in, use, &nuse, def, &ndef);
+        for (int i = 0; i < ndef; i++)
+            known[def[i]] = 0;
+        if (in->pattern == IN_LEA && in->dst.pattern == OP_VREG
+            && in->src.pattern == OP_MEM && in->src.reg == RBP) {
+            known[in->dst.reg] = block;
+            disp[in->dst.reg] = in->src.val;
+        }
+    }
+
+    free(known);
+    free(disp);
+}
+
+// replace register operand v by w
+void rename_vreg(Operand *op, int v, int w) {
+    if ((op->pattern == OP_VREG || op->pattern == OP_VMEM) && op->reg == v)
+        op->reg = w;
+}
+
+// replace uses of d in "mov d, s" by s when mov is only definition of d and
+// s keeps its value until last use of d in block
+void forward_copies(Inst *insts, int nvreg) {
+    int *uses = count_uses(insts, nvreg);
+    int *defs = calloc(nvreg + 1, sizeof(int));
+    int use[3], def[1], nuse, ndef;
+    for (Inst *in = insts; in; in = in->next) {
+        inst_vregs(in, use, &nuse, def, &ndef);
+        for (int i = 0; i < ndef; i++)
+            defs[def[i]]++;
+    }
+
+    for (Inst *in = insts; in; in = in->next) {
+        if (in->pattern != IN_MOV || in->dst.pattern != OP_VREG || in->src.pattern != OP_VREG)
+            continue;
+        int d = in->dst.reg, s = in->src.reg;
+        if (defs[d] != 1 || d == s)
+            continue;
+
+        // find last use of d before s changes or block ends
+        int left = uses[d];
+        Inst *last = in;
+        for (Inst *n = in->next; n && left; n = n->next) {
+            if (n->pattern == IN_LABEL)
+                break;
+            inst_vregs(n, use, &nuse, def, &ndef);
+            for (int i = 0; i < nuse; i++)
+                left -= use[i] == d;
+            if (ndef && def[0] == s && left)
+                break;
+            last = n;
+            if (is_terminator(n))
+                break;
+        }
+        if (left)
+            continue;
+
+        for (Inst *n = in->next; n != last->next; n = n->next) {
+            rename_vreg(&n->dst, d, s);
+            rename_vreg(&n->src, d, s);
+        }
+        uses[s] += uses[d];
+        uses[d] = 0;
+    }
+
+    free(uses);
+    free(defs);
+}
+
+// instruction which updates its destination register from its old value
+bool is_update(Inst *in) {
+    switch (in->pattern) {
+    case IN_ADD:
+    case IN_SUB:
+    case IN_IMUL:
+    case IN_NEG:
+    case IN_SHL:
+    case IN_SAR:
+    case IN_SHR:
+        return true;
+    }
+    return false;
+}
+
+// turn "mov t, v; op t, x; mov v, t" into "op v, x" when t is used nowhere
+// else and nothing in between touches v
+Inst *fold_round_trips(Inst *insts, int nvreg) {
+    int *uses = count_uses(insts, nvreg);
+    int *defs = calloc(nvreg + 1, sizeof(int));
+    int use[3], def[1], nuse, ndef;
+    for (Inst *in = insts; in; in = in->next) {
+        inst_vregs(in, use, &nuse, def, &ndef);
+        for (int i = 0; i < ndef; i++)
+            defs[def[i]]++;
+    }
+
+    Inst head = {};
+    head.next = insts;
+    for (Inst *prev = &head; prev->next; prev = prev->next) {
+        Inst *in = prev->next;
+        if (in->pattern != IN_MOV || in->dst.pattern != OP_VREG || in->src.pattern != OP_VREG)
+            continue;
+        int t = in->dst.reg, v = in->src.reg;
+        if (t == v || uses[t] != 2 || defs[t] != 2)
+            continue;
+
+        // op may read v, other instructions up to copy back must not
+        Inst *op = NULL, *back = NULL;
+        for (Inst *n = in->next; n && n->pattern != IN_LABEL; n = n->next) {
+            if (!op && is_update(n) && n->dst.pattern == OP_VREG && n->dst.reg == t) {
+                op = n;
+            } else if (op && n->pattern == IN_MOV && n->dst.pattern == OP_VREG
+                       && n->dst.reg == v && n->src.pattern == OP_VREG && n->src.reg == t) {
+                back = n;
+                break;
+            } else {
+                inst_vregs(n, use, &nuse, def, &ndef);
+                bool touched = ndef && (def[0] == v || def[0] == t);
+                for (int i = 0; i < nuse; i++)
+                    touched |= use[i] == v || use[i] == t;
+                if (touched)
+                    break;
+            }
+            if (is_terminator(n))
+                break;
+        }
+        if (!back)
+            continue;
+
+        op->dst.reg = v;
+        back->dst.reg = back->src.reg = v;
+        prev->next = in->next;
+        uses[t] = 0;
+    }
+
+    free(uses);
+    free(defs);
+    return head.next;
+}
+
+// remove pure instructions whose result is never used or is overwritten
+// before use in block
+Inst *remove_dead_defs(Inst *insts, int nvreg) {
+    int *uses = count_uses(insts, nvreg);
+    int n = 0;
+    for (Inst *in = insts; in; in = in->next)
+        n++;
+    Inst **code = calloc(n + 1, sizeof(Inst *));
+    n = 0;
+    for (Inst *in = insts; in; in = in->next)
+        code[n++] = in;
+
+    // register is dead if stamped with current block
+    int *dead = calloc(nvreg + 1, sizeof(int));
+    int block = 1;
+    bool *removed = calloc(n + 1, sizeof(bool));
+    int use[3], def[1], nuse, ndef;
+
+    for (int i = n - 1; i >= 0; i--) {
+        Inst *in = code[i];
+
+        // value may be used in other blocks
+        if (is_terminator(in) || in->pattern == IN_LABEL) {
+            block++;
+            continue;
+        }
+
+        inst_vregs(in, use, &nuse, def, &ndef);
+        if (ndef && (dead[def[0]] == block || !uses[def[0]]) && is_pure(in)) {
+            removed[i] = true;
+            continue;
+        }
+        for (int j = 0; j < ndef; j++)
+            dead[def[j]] = block;
+        for (int j = 0; j < nuse; j++)
+            dead[use[j]] = 0;
+    }
+
+    Inst head = {};
+    Inst *cur = &head;
+    for (int i = 0; i < n; i++) {
+        if (removed[i])
+            continue;
+        cur = cur->next = code[i];
+    }
+    cur->next = NULL;
+
+    free(code);
+    free(uses);
+    free(dead);
+    free(removed);
+    return head.next;
+}
+
+// fuse "cmp; setcc v; movzb v; cmp v, 0; je" into single conditional jump
+void fuse_compare_branch(Inst *insts, int nvreg) {
+    int *uses = count_uses(insts, nvreg);
+
+    for (Inst *in = insts; in; in = in->next) {
+        Inst *set = in->next;
+        if (in->pattern != IN_CMP || !set || set->pattern != IN_SETCC)
+            continue;
+        Inst *zb = set->next;
+        Inst *test = zb ? zb->next : NULL;
+        Inst *jump = test ? test->next : NULL;
+        if (!jump || zb->pattern != IN_MOVZB || test->pattern != IN_CMP
+            || jump->pattern != IN_JCC)
+            continue;
+
+        Operand v = set->dst;
+        if (v.pattern != OP_VREG || !same_operand(zb->dst, v) || !same_operand(test->dst, v)
+            || test->src.pattern != OP_IMM || test->src.val != 0)
+            continue;
+        if (jump->cc != CC_E && jump->cc != CC_NE)
+            continue;
+
+        // value of comparison must not be used anywhere else
+        int own = 3 + same_operand(in->dst, v) + same_operand(in->src, v);
+        if (uses[v.reg] != own)
+            continue;
+
+        jump->cc = jump->cc == CC_E ? invert_cc(set->cc) : set->cc;
+        in->next = jump;
+    }
+
+    free(uses);
+}
+
+// optimize instructions holding virtual registers
+Inst *peephole_vreg(Inst *insts, int nvreg) {
+    fold_frame_address(insts, nvreg);
+    forward_copies(insts, nvreg);
+    insts = fold_round_trips(insts, nvreg);
+    fuse_compare_branch(insts, nvreg);
+    return remove_dead_defs(insts, nvreg);
+}
+
+bool is_jump(Inst *in) {
+    return in->pattern == IN_JMP || in->pattern == IN_JCC;
+}
+
+// largest label number referenced by instructions
+int max_label(Inst *insts) {
+    int max = 0;
+    for (Inst *in = insts; in; in = in->next)
+        if ((is_jump(in) || in->pattern == IN_LABEL) && in->label > max)
+            max = in->label;
+    return max;
+}
+
+// retarget jumps to unconditional jumps
+void thread_jumps(Inst *insts, Inst **label_at) {
+    for (Inst *in = insts; in; in = in->next) {
+        if (!is_jump(in))
+            continue;
+        for (int hop = 0; hop < 8; hop++) {
+            Inst *target = label_at[in->label];
+            while (target && target->pattern == IN_LABEL)
+                target = target->next;
+            if (!target || target->pattern != IN_JMP || target->label == in->label)
+                break;
+            in->label = target->label;
+        }
+    }
+}
+
+// check whether label follows instruction with only labels in between
+bool falls_into(Inst *in, int label) {
+    for (Inst *n = in->next; n && n->pattern == IN_LABEL; n = n->next)
+        if (n->label == label)
+            return true;
+    return false;
+}
+
+// optimize instructions of function after register allocation
+Inst *peephole(Inst *insts) {
+    int nlabel = max_label(insts) + 1;
+    Inst **label_at = calloc(nlabel, sizeof(Inst *));
+    int *refs = calloc(nlabel, sizeof(int));
+    for (Inst *in = insts; in; in = in->next)
+        if (in->pattern == IN_LABEL)
+            label_at[in->label] = in;
+
+    thread_jumps(insts, label_at);
+    for (Inst *in = insts; in; in = in->next)
+        if (is_jump(in))
+            refs[in->label]++;
+
+    Inst head = {};
+    head.next = insts;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (Inst *prev = &head; prev->next; ) {
+            Inst *in = prev->next;
+            Inst *next = in->next;
+
+            // mov r, r
+            if (in->pattern == IN_MOV && same_operand(in->dst, in->src)) {
+                prev->next = next;
+                changed = true;
+                continue;
+            }
+
+            // mov a, b; mov b, a
+            if (in->pattern == IN_MOV && next && next->pattern == IN_MOV
+                && same_operand(in->dst, next->src) && same_operand(in->src, next->dst)
+                && !(in->src.pattern == OP_MEM && in->src.reg == in->dst.reg)) {
+                in->next = next->next;
+                changed = true;
+                continue;
+            }
+
+            // push a; pop b
+            if (in->pattern == IN_PUSH && next && next->pattern == IN_POP
+                && !(in->src.pattern == OP_MEM && next->dst.pattern == OP_MEM)) {
+                in->pattern = IN_MOV;
+                in->dst = next->dst;
+                in->next = next->next;
+                changed = true;
+                continue;
+            }
+
+            // jump to following label
+            if (is_jump(in) && falls_into(in, in->label)) {
+                refs[in->label]--;
+                prev->next = next;
+                changed = true;
+                continue;
+            }
+
+            // unreachable code after jump
+            if (in->pattern == IN_JMP || in->pattern == IN_RET || in->pattern == IN_TAILCALL) {
+                while (in->next && in->next->pattern != IN_LABEL
+                       && in->next->pattern != IN_SYMBOL) {
+                    if (is_jump(in->next))
+                        refs[in->next->label]--;
+                    in->next = in->next->next;
+                    changed = true;
+                }
+            }
+
+            // unused label
+            if (in->pattern == IN_LABEL && !refs[in->label]) {
+                prev->next = next;
+                changed = true;
+                continue;
+            }
+
+            prev = in;
+        }
+    }
+
+    free(label_at);
+    free(refs);
+    return head.next;
+}
@@ -0,0 +1,204 @@
+#include "9cc.h"
+
+// functions of instrumented program, whose counters follow each other in
+// its .bss (node counts point into prof_numbers to number them)
+ProfFunc *prof_funcs;
+int nprof_func;
+int nprof_counter;
+long *prof_numbers;
+
+// counters of program run by --run (in its mapped .bss)
+long *profile_counts;
+
+// profile read back, in open addressing table by name
+ProfFunc *use_funcs;
+int use_cap;
+
+// hash of profile contents (part of cache keys)
+unsigned long profile_hash;
+
+int count_branches(Node *node) {
+    int n = 0;
+    for (; node; node = node->next) {
+        n += node->pattern == ND_IF || node->pattern == ND_WHILE || node->pattern == ND_FOR;
+        n += count_branches(node->lhs) + count_branches(node->rhs) + count_branches(node->cond)
+            + count_branches(node->then) + count_branches(node->els) + count_branches(node->init)
+            + count_branches(node->inc) + count_branches(node->stmts) + count_branches(node->args);
+    }
+    return n;
+}
+
+// give branches counters in same order as count_branches
+long *attach_counts(Node *node, long *counts) {
+    for (; node; node = node->next) {
+        if (node->pattern == ND_IF || node->pattern == ND_WHILE || node->pattern == ND_FOR) {
+            node->count = counts;
+            counts += 2;
+        }
+        counts = attach_counts(node->lhs, counts);
+        counts = attach_counts(node->rhs, counts);
+        counts = attach_counts(node->cond, counts);
+        counts = attach_counts(node->then, counts);
+        counts = attach_counts(node->els, counts);
+        counts = attach_counts(node->init, counts);
+        counts = attach_counts(node->inc, counts);
+        counts = attach_counts(node->stmts, counts);
+        counts = attach_counts(node->args, counts);
+    }
+    return counts;
+}
+
+ProfFunc *find_profile(char *name) {
+    if (!use_cap)
+        return NULL;
+    unsigned i = hash_string(name, strlen(name)) & (use_cap - 1);
+    for (; use_funcs[i].name; i = (i + 1) & (use_cap - 1))
+        if (!strcmp(use_funcs[i].name, name))
+            return &use_funcs[i];
+    return NULL;
+}
+
+// number counters of instrumented program
+void number_counters(Function *program) {
+    for (Function *fn = program; fn; fn = fn->next)
+        nprof_func++;
+    prof_funcs = calloc(nprof_func + 1, sizeof(ProfFunc));
+    nprof_func = 0;
+    for (Function *fn = program; fn; fn = fn->next) {
+        int n = 1 + 2 * count_branches(fn->node);
+        prof_funcs[nprof_func++] = (ProfFunc){strdup(fn->name), NULL, n, nprof_counter};
+        nprof_counter += n;
+    }
+    prof_numbers = calloc(nprof_counter + 1, sizeof(long));
+    for (int i = 0; i < nprof_func; i++)
+        prof_funcs[i].counts = prof_numbers + prof_funcs[i].offset;
+}
+
+// point functions and branches of program to their counters (before
+// any transformation, so both builds number them alike)
+void attach_profile(Function *program) {
+    if (opt_profile_generate)
+        number_counters(program);
+
+    int i = 0;
+    for (Function *fn = program; fn; fn = fn->next) {
+        int n = 1 + 2 * count_branches(fn->node);
+        long *counts;
+        if (opt_profile_generate) {
+            counts = prof_funcs[i++].counts;
+        } else {
+            // changed functions have other counters and get none
+            ProfFunc *pf = find_profile(fn->name);
+            if (!pf || pf->n != n)
+                continue;
+            counts = pf->counts;
+        }
+        fn->count = counts;
+        attach_counts(fn->node, counts + 1);
+    }
+}
+
+// byte offset of counter in .bss of instrumented program
+long counter_offset(long *count) {
+    return (count - prof_numbers) * sizeof(long);
+}
+
+// profiled count of edge of branch (-1 if unknown; counters of
+// instrumented build only number its counters)
+long edge_count(Node *node, int edge) {
+    return opt_profile_use && node->count ? node->count[edge] : -1;
+}
+
+// profiled entries of function (-1 if unknown)
+long entry_count(Function *fn) {
+    return opt_profile_use && fn->count ? fn->count[0] : -1;
+}
+
+// append counters of program run by --run as lines "name count..." (as
+// writer of instrumented executable does)
+void write_profile() {
+    Buffer buf = {};
+    for (int i = 0; i < nprof_func; i++) {
+        buf_str(&buf, prof_funcs[i].name);
+        for (int j = 0; j < prof_funcs[i].n; j++) {
+            buf_char(&buf, ' ');
+            buf_int(&buf, profile_counts[prof_funcs[i].offset + j]);
+        }
+        buf_char(&buf, '\n');
+    }
+    FILE *fp = fopen(opt_profile_generate, "a");
+    if (!fp || fwrite(buf.data, 1, buf.len, fp) != buf.len || fclose(fp))
+        error("cannot write %s: %s", opt_profile_generate, strerror(errno));
+    free(buf.data);
+}
+
+// add line of profile (runs appended to same file add up)
+void add_profile(char *name, long *counts, int n) {
+    unsigned i = hash_string(name, strlen(name)) & (use_cap - 1);
+    for (; use_funcs[i].name; i = (i + 1) & (use_cap - 1)) {
+        ProfFunc *pf = &use_funcs[i];
+        if (strcmp(pf->name, name))
+            continue;
+        if (pf->n != n) {
+            // function changed between runs, so later one wins
+            free(pf->name);
+            free(pf->counts);
+            *pf = (ProfFunc){name, counts, n};
+            return;
+        }
+        for (int j = 0; j < n; j++)
+            pf->counts[j] += counts[j];
+        free(name);
+        free(counts);
+        return;
+    }
+    use_funcs[i] = (ProfFunc){name, counts, n};
+}
+
+// read profile written by instrumented program
+void read_profile(char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        error("cannot open %s: %s", path, strerror(errno));
+    Buffer buf = {};
+    char tmp[4096];
+    for (int n; (n = fread(tmp, 1, sizeof(tmp), fp)) > 0; )
+        buf_write(&buf, tmp, n);
+    fclose(fp);
+    buf_char(&buf, 0);
+    profile_hash = hash_bytes(0xcbf29ce484222325UL, buf.data, buf.len);
+
+    int nline = 0;
+    for (int i = 0; i < buf.len; i++)
+        nline += buf.data[i] == '\n';
+    for (use_cap = 16; use_cap < nline * 2; use_cap *= 2)
+        ;
+    use_funcs = calloc(use_cap, sizeof(ProfFunc));
+
+    for (char *p = buf.data; *p; ) {
+        char *end = strchr(p, '\n');
+        if (!end)
+            end = p + strlen(p);
+        char *name = p;
+        while (p < end && *p != ' ')
+            p++;
+        if (p == name)
+            error("%s: malformed profile", path);
+        name = strndup(name, p - name);
+
+        int n = 0;
+        for (char *q = p; q < end; q++)
+            n += *q == ' ';
+        long *counts = calloc(n + 1, sizeof(long));
+        for (int i = 0; i < n; i++) {
+            char *next;
+            counts[i] = strtol(p, &next, 10);
+            if (next == p || counts[i] < 0)
+                error("%s: malformed profile", path);
+            p = next;
+        }
+        add_profile(name, counts, n);
+        p = *end ? end + 1 : end;
+    }
+    free(buf.data);
+}
@@ -0,0 +1,562 @@
+#include "9cc.h"
+
+// allocatable registers
+Reg caller_saved_reg[] = {R10, R11};
+Reg callee_saved_reg[] = {RBX, R12, R13, R14, R15};
+
+// leaf function makes no calls, so argument registers are free too
+Reg leaf_reg[] = {RDI, RSI, RCX, R8, R9, R10, R11};
+
+// scratch registers for spilled operands (never allocated)
+#define SCRATCH_BASE RAX
+#define SCRATCH_TMP RDX
+
+// live interval of virtual register
+typedef struct Interval Interval;
+struct Interval {
+    int vreg; // Virtual register
+    int start; // First live position
+    int end; // Last live position
+    int reg; // Assigned physical register (-1 if spilled)
+    int hint; // Register copied to definition (-1 if none)
+    Interval *copy; // Interval ending where it is copied to definition
+    int slot; // Spill slot offset from RBP
+};
+
+// block of instructions
+typedef struct Block Block;
+struct Block {
+    int first; // Index of first instruction
+    int last; // Index of last instruction
+    int succ[2]; // Successor blocks (-1 if none)
+    unsigned long *live_in; // Live virtual registers at entry
+    unsigned long *live_out; // Live virtual registers at exit
+};
+
+// collect virtual registers used and defined by instruction
+void inst_vregs(Inst *in, int *use, int *nuse, int *def, int *ndef) {
+    *nuse = 0;
+    *ndef = 0;
+
+    if (in->src.pattern == OP_VREG || in->src.pattern == OP_VMEM)
+        use[(*nuse)++] = in->src.reg;
+    if (in->dst.pattern == OP_VMEM)
+        use[(*nuse)++] = in->dst.reg;
+    if (in->dst.pattern != OP_VREG)
+        return;
+
+    switch (in->pattern) {
+    case IN_MOV:
+    case IN_LEA:
+    case IN_SETCC:
+    case IN_POP:
+        def[(*ndef)++] = in->dst.reg;
+        return;
+    case IN_CMP:
+        use[(*nuse)++] = in->dst.reg;
+        return;
+    default:
+        use[(*nuse)++] = in->dst.reg;
+        def[(*ndef)++] = in->dst.reg;
+        return;
+    }
+}
+
+bool is_terminator(Inst *in) {
+    return in->pattern == IN_JMP || in->pattern == IN_JCC;
+}
+
+bool bit_test(unsigned long *set, int i) {
+    return set[i / 64] >> (i % 64) & 1;
+}
+
+void bit_set(unsigned long *set, int i) {
+    set[i / 64] |= 1UL << (i % 64);
+}
+
+void bit_clear(unsigned long *set, int i) {
+    set[i / 64] &= ~(1UL << (i % 64));
+}
+
+// split instructions into blocks and link successors
+Block *build_blocks(Inst **code, int n, int *nblock) {
+    // map label to index of instruction
+    int min_label = 0, max_label = -1;
+    for (int i = 0; i < n; i++) {
+        if (code[i]->pattern != IN_LABEL)
+            continue;
+        if (max_label < min_label) {
+            min_label = max_label = code[i]->label;
+            continue;
+        }
+        if (code[i]->label < min_label)
+            min_label = code[i]->label;
+        if (code[i]->label > max_label)
+            max_label = code[i]->label;
+    }
+    int *label_block = calloc(max_label - min_label + 1, sizeof(int));
+
+    // decide leaders
+    Block *blocks = calloc(n, sizeof(Block));
+    int cnt = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || code[i]->pattern == IN_LABEL || is_terminator(code[i - 1])) {
+            if (cnt)
+                blocks[cnt - 1].last = i - 1;
+            blocks[cnt++].first = i;
+        }
+        if (code[i]->pattern == IN_LABEL)
+            label_block[code[i]->label - min_label] = cnt - 1;
+    }
+    if (cnt)
+        blocks[cnt - 1].last = n - 1;
+
+    // link successors
+    for (int b = 0; b < cnt; b++) {
+        Inst *last = code[blocks[b].last];
+        blocks[b].succ[0] = blocks[b].succ[1] = -1;
+        if (is_terminator(last))
+            blocks[b].succ[0] = label_block[last->label - min_label];
+        if (last->pattern != IN_JMP && last->pattern != IN_TAILCALL && b + 1 < cnt)
+            blocks[b].succ[1] = b + 1;
+    }
+
+    free(label_block);
+    *nblock = cnt;
+    return blocks;
+}
+
+// extend interval to cover position
+void extend(Interval *iv, int pos) {
+    if (pos < iv->start)
+        iv->start = pos;
+    if (pos > iv->end)
+        iv->end = pos;
+}
+
+// compute live intervals by dataflow analysis over blocks
+void compute_intervals(Inst **code, int n, Interval *iv, int nvreg) {
+    int nblock;
+    Block *blocks = build_blocks(code, n, &nblock);
+    int use[3], def[1], nuse, ndef;
+
+    // intervals cover every reference
+    for (int v = 0; v <= nvreg; v++) {
+        iv[v].vreg = v;
+        iv[v].start = n;
+        iv[v].end = -1;
+        iv[v].reg = -1;
+        iv[v].hint = -1;
+    }
+
+    // registers defined before any use and referenced in one block only are
+    // never live across blocks, so only the others take part in dataflow
+    int *home = calloc(nvreg + 1, sizeof(int));
+    int *gid = calloc(nvreg + 1, sizeof(int));
+    for (int b = 0; b < nblock; b++) {
+        for (int i = blocks[b].first; i <= blocks[b].last; i++) {
+            inst_vregs(code[i], use, &nuse, def, &ndef);
+            for (int j = 0; j < nuse; j++) {
+                int v = use[j];
+                if (!home[v] || home[v] != b + 1)
+                    gid[v] = -1;
+                home[v] = b + 1;
+                extend(&iv[v], i);
+            }
+            for (int j = 0; j < ndef; j++) {
+                int v = def[j];
+                if (home[v] && home[v] != b + 1)
+                    gid[v] = -1;
+                home[v] = b + 1;
+                extend(&iv[v], i);
+            }
+        }
+    }
+    int nglobal = 0;
+    for (int v = 1; v <= nvreg; v++)
+        gid[v] = gid[v] < 0 ? nglobal++ : -1;
+
+    int words = nglobal / 64 + 1;
+    for (int b = 0; b < nblock; b++) {
+        blocks[b].live_in = calloc(words, sizeof(unsigned long));
+        blocks[b].live_out = calloc(words, sizeof(unsigned long));
+    }
+    unsigned long *live = calloc(words, sizeof(unsigned long));
+
+    // iterate until live sets settle
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int b = nblock - 1; b >= 0; b--) {
+            Block *blk = &blocks[b];
+            for (int k = 0; k < 2; k++) {
+                if (blk->succ[k] < 0)
+                    continue;
+                for (int w = 0; w < words; w++)
+                    blk->live_out[w] |= blocks[blk->succ[k]].live_in[w];
+            }
+
+            memcpy(live, blk->live_out, words * sizeof(unsigned long));
+            for (int i = blk->last; i >= blk->first; i--) {
+                inst_vregs(code[i], use, &nuse, def, &ndef);
+                for (int j = 0; j < ndef; j++)
+                    if (gid[def[j]] >= 0)
+                        bit_clear(live, gid[def[j]]);
+                for (int j = 0; j < nuse; j++)
+                    if (gid[use[j]] >= 0)
+                        bit_set(live, gid[use[j]]);
+            }
+
+            if (memcmp(live, blk->live_in, words * sizeof(unsigned long))) {
+                memcpy(blk->live_in, live, words * sizeof(unsigned long));
+                changed = true;
+            }
+        }
+    }
+
+    // registers live on entry or exit span the start or end of block
+    int *global = calloc(nglobal + 1, sizeof(int));
+    for (int v = 1; v <= nvreg; v++)
+        if (gid[v] >= 0)
+            global[gid[v]] = v;
+    for (int b = 0; b < nblock; b++) {
+        Block *blk = &blocks[b];
+        for (int w = 0; w < words; w++) {
+            for (unsigned long bits = blk->live_in[w]; bits; bits &= bits - 1)
+                extend(&iv[global[w * 64 + __builtin_ctzl(bits)]], blk->first);
+            for (unsigned long bits = blk->live_out[w]; bits; bits &= bits - 1)
+                extend(&iv[global[w * 64 + __builtin_ctzl(bits)]], blk->last);
+        }
+    }
+
+    for (int b = 0; b < nblock; b++) {
+        free(blocks[b].live_in);
+        free(blocks[b].live_out);
+    }
+    free(blocks);
+    free(live);
+    free(home);
+    free(gid);
+    free(global);
+}
+
+// index of first call after position (calls are in ascending order)
+int next_call(int *calls, int ncall, int pos) {
+    int lo = 0, hi = ncall;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (calls[mid] <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// check whether interval is live across call instruction
+bool crosses_call(Interval *iv, int *calls, int ncall) {
+    int i = next_call(calls, ncall, iv->start);
+    return i < ncall && calls[i] < iv->end;
+}
+
+// order by start, intervals copied from register first
+int cmp_start(const void *a, const void *b) {
+    Interval *x = *(Interval **)a, *y = *(Interval **)b;
+    if (x->start != y->start)
+        return x->start - y->start;
+    if ((x->hint >= 0) != (y->hint >= 0))
+        return x->hint >= 0 ? -1 : 1;
+    return x->vreg - y->vreg;
+}
+
+// take a free register from pool
+int take_reg(Reg *pool, int npool, bool *busy) {
+    for (int i = 0; i < npool; i++) {
+        if (!busy[pool[i]]) {
+            busy[pool[i]] = true;
+            return pool[i];
+        }
+    }
+    return -1;
+}
+
+// take hinted register if it is free and in pool
+int take_hint(int hint, Reg *pool, int npool, bool *busy) {
+    for (int i = 0; i < npool; i++) {
+        if (pool[i] == hint && !busy[hint]) {
+            busy[hint] = true;
+            return hint;
+        }
+    }
+    return -1;
+}
+
+// linear scan over intervals sorted by start position
+void linear_scan(Interval **sorted, int cnt, int *calls, int ncall, bool leaf, int *pinned) {
+    Interval **active = calloc(cnt + 1, sizeof(Interval *));
+    int nactive = 0;
+    bool busy[16] = {};
+    Reg *caller = leaf ? leaf_reg : caller_saved_reg;
+    int ncaller = leaf ? sizeof(leaf_reg) / sizeof(*leaf_reg)
+                       : sizeof(caller_saved_reg) / sizeof(*caller_saved_reg);
+    int ncallee = sizeof(callee_saved_reg) / sizeof(*callee_saved_reg);
+
+    for (int i = 0; i < cnt; i++) {
+        Interval *cur = sorted[i];
+
+        // expire old intervals
+        int k = 0;
+        for (int j = 0; j < nactive; j++) {
+            if (active[j]->end < cur->start)
+                busy[active[j]->reg] = false;
+            else
+                active[k++] = active[j];
+        }
+        nactive = k;
+
+        // copy of value which dies there takes over its register
+        for (int j = 0; cur->copy && j < nactive; j++) {
+            if (active[j] == cur->copy) {
+                cur->reg = cur->copy->reg;
+                active[j] = cur;
+                break;
+            }
+        }
+        if (cur->reg >= 0)
+            continue;
+
+        // registers referenced by instructions stay taken until then
+        bool taken[16];
+        for (int r = 0; r < 16; r++)
+            taken[r] = busy[r] || pinned[r] > cur->start;
+
+        // values live across calls prefer callee-saved registers, copies
+        // prefer register they are copied from
+        cur->reg = take_hint(cur->hint, caller, ncaller, taken);
+        if (cur->reg < 0 && crosses_call(cur, calls, ncall)) {
+            cur->reg = take_reg(callee_saved_reg, ncallee, taken);
+            if (cur->reg < 0)
+                cur->reg = take_reg(caller, ncaller, taken);
+        } else if (cur->reg < 0) {
+            cur->reg = take_reg(caller, ncaller, taken);
+            if (cur->reg < 0)
+                cur->reg = take_reg(callee_saved_reg, ncallee, taken);
+        }
+
+        if (cur->reg >= 0) {
+            busy[cur->reg] = true;
+            active[nactive++] = cur;
+            continue;
+        }
+
+        // spill the interval which ends last
+        int victim = -1;
+        for (int j = 0; j < nactive; j++)
+            if (victim < 0 || active[j]->end > active[victim]->end)
+                victim = j;
+        if (victim >= 0 && active[victim]->end > cur->end) {
+            cur->reg = active[victim]->reg;
+            active[victim]->reg = -1;
+            active[victim] = cur;
+        }
+    }
+
+    free(active);
+}
+
+Operand reg_operand(int reg) {
+    return (Operand){OP_REG, reg, 0};
+}
+
+Operand mem_operand(int base, long disp) {
+    return (Operand){OP_MEM, base, disp};
+}
+
+// append instruction to list
+Inst *append_inst(Inst *cur, InstPattern pattern, Operand dst, Operand src) {
+    Inst *in = new_inst(pattern, dst, src);
+    cur->next = in;
+    return in;
+}
+
+// replace virtual register operand by its location
+Operand assign_operand(Operand op, Interval *iv, Inst **cur) {
+    switch (op.pattern) {
+    case OP_VREG:
+        if (iv[op.reg].reg >= 0)
+            return reg_operand(iv[op.reg].reg);
+        return mem_operand(RBP, -iv[op.reg].slot);
+    case OP_VMEM:
+        if (iv[op.reg].reg >= 0)
+            return mem_operand(iv[op.reg].reg, op.val);
+        *cur = append_inst(*cur, IN_MOV, reg_operand(SCRATCH_BASE),
+                           mem_operand(RBP, -iv[op.reg].slot));
+        return mem_operand(SCRATCH_BASE, op.val);
+    }
+    return op;
+}
+
+// rewrite instruction whose operands are not encodable
+Inst *legalize(Inst *cur, Inst *in) {
+    bool dst_mem = in->dst.pattern == OP_MEM;
+    bool src_mem = in->src.pattern == OP_MEM;
+    Operand tmp = reg_operand(SCRATCH_TMP);
+
+    switch (in->pattern) {
+    case IN_MOV:
+    case IN_ADD:
+    case IN_SUB:
+    case IN_CMP:
+        // only mov to register takes 64-bit immediate
+        if (dst_mem && (src_mem || (in->src.pattern == OP_IMM && !is_imm32(in->src.val)))) {
+            cur = append_inst(cur, IN_MOV, tmp, in->src);
+            in->src = tmp;
+        }
+        break;
+    case IN_LEA:
+        if (dst_mem) {
+            cur = append_inst(cur, IN_LEA, tmp, in->src);
+            in->pattern = IN_MOV;
+            in->src = tmp;
+        }
+        break;
+    case IN_IMUL:
+        if (dst_mem) {
+            cur = append_inst(cur, IN_MOV, tmp, in->dst);
+            cur = append_inst(cur, IN_IMUL, tmp, in->src);
+            in->pattern = IN_MOV;
+            in->src = tmp;
+        }
+        break;
+    case IN_MOVZB:
+        if (dst_mem) {
+            cur = append_inst(cur, IN_MOVZB, tmp, in->src);
+            in->pattern = IN_MOV;
+            in->src = tmp;
+        }
+        break;
+    }
+
+    cur->next = in;
+    return in;
+}
+
+// allocate physical registers to virtual registers
+RegAlloc regalloc(Inst *insts, int nvreg, int stack_size, bool leaf) {
+    RegAlloc ra = {};
+
+    // flatten instructions
+    int n = 0;
+    for (Inst *in = insts; in; in = in->next)
+        n++;
+    Inst **code = calloc(n + 1, sizeof(Inst *));
+    int *calls = calloc(n + 1, sizeof(int));
+    int ncall = 0;
+    n = 0;
+    for (Inst *in = insts; in; in = in->next) {
+        if (in->pattern == IN_CALL)
+            calls[ncall++] = n;
+        code[n++] = in;
+    }
+
+    // compute and sort intervals
+    Interval *iv = calloc(nvreg + 1, sizeof(Interval));
+    compute_intervals(code, n, iv, nvreg);
+
+    // find last reference of each physical register and copies between
+    // registers at start of intervals
+    int pinned[16];
+    for (int r = 0; r < 16; r++)
+        pinned[r] = -1;
+    for (int i = 0; i < n; i++) {
+        Inst *in = code[i];
+        if (in->src.pattern == OP_REG || in->src.pattern == OP_MEM)
+            pinned[in->src.reg] = i;
+        if (in->dst.pattern == OP_REG || in->dst.pattern == OP_MEM)
+            pinned[in->dst.reg] = i;
+        if (in->pattern != IN_MOV || in->dst.pattern != OP_VREG || iv[in->dst.reg].start != i)
+            continue;
+        if (in->src.pattern == OP_REG)
+            iv[in->dst.reg].hint = in->src.reg;
+        if (in->src.pattern == OP_VREG && iv[in->src.reg].end == i)
+            iv[in->dst.reg].copy = &iv[in->src.reg];
+    }
+
+    Interval **sorted = calloc(nvreg + 1, sizeof(Interval *));
+    int cnt = 0;
+    for (int v = 1; v <= nvreg; v++)
+        if (iv[v].end >= 0)
+            sorted[cnt++] = &iv[v];
+    qsort(sorted, cnt, sizeof(Interval *), cmp_start);
+
+    linear_scan(sorted, cnt, calls, ncall, leaf, pinned);
+
+    // give spill slots and save slots
+    bool used[16] = {};
+    for (int i = 0; i < cnt; i++) {
+        if (sorted[i]->reg >= 0) {
+            used[sorted[i]->reg] = true;
+            continue;
+        }
+        stack_size += 8;
+        sorted[i]->slot = stack_size;
+    }
+    for (int i = 0; i < sizeof(callee_saved_reg) / sizeof(*callee_saved_reg); i++) {
+        if (!used[callee_saved_reg[i]])
+            continue;
+        stack_size += 8;
+        ra.save_offset[callee_saved_reg[i]] = stack_size;
+    }
+
+    // RSP stays 16 byte aligned below frame
+    ra.stack_size = (stack_size + 15) / 16 * 16;
+
+    // caller-saved registers live across each call
+    int *call_saved = calloc(n + 1, sizeof(int));
+    for (int i = 0; i < cnt; i++) {
+        Interval *it = sorted[i];
+        if (it->reg != R10 && it->reg != R11)
+            continue;
+        for (int j = next_call(calls, ncall, it->start); j < ncall && calls[j] < it->end; j++)
+            call_saved[calls[j]] |= 1 << it->reg;
+    }
+
+    // rewrite operands
+    Inst head = {};
+    Inst *cur = &head;
+    for (int i = 0; i < n; i++) {
+        Inst *in = code[i];
+        in->next = NULL;
+
+        // save caller-saved registers live across call
+        int saved[16], nsaved = 0;
+        if (in->pattern == IN_CALL) {
+            for (int j = 0; j < sizeof(caller_saved_reg) / sizeof(*caller_saved_reg); j++)
+                if (call_saved[i] >> caller_saved_reg[j] & 1)
+                    saved[nsaved++] = caller_saved_reg[j];
+            for (int j = 0; j < nsaved; j++)
+                cur = append_inst(cur, IN_PUSH, (Operand){}, reg_operand(saved[j]));
+
+            // pad odd number of pushes to keep call aligned
+            if (nsaved % 2)
+                cur = append_inst(cur, IN_SUB, reg_operand(RSP), (Operand){OP_IMM, 0, 8});
+        }
+
+        in->dst = assign_operand(in->dst, iv, &cur);
+        in->src = assign_operand(in->src, iv, &cur);
+        cur = legalize(cur, in);
+
+        if (nsaved % 2)
+            cur = append_inst(cur, IN_ADD, reg_operand(RSP), (Operand){OP_IMM, 0, 8});
+        for (int j = nsaved - 1; j >= 0; j--)
+            cur = append_inst(cur, IN_POP, reg_operand(saved[j]), (Operand){});
+    }
+    ra.insts = head.next;
+
+    free(code);
+    free(calls);
+    free(call_saved);
+    free(iv);
+    free(sorted);
+    return ra;
+}
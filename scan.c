@@ -0,0 +1,122 @@
+#include "9cc.h"
+
+// Character-class scanners used by tokenizer. Each returns the first
+// position in [p, end) whose character is not in the class.
+
+bool is_space_char(char c) {
+    return c == ' ' || ('\t' <= c && c <= '\r');
+}
+
+bool is_digit_char(char c) {
+    return '0' <= c && c <= '9';
+}
+
+bool is_ident_char(char c) {
+    return ('a' <= c && c <= 'z')
+        || ('A' <= c && c <= 'Z')
+        || ('0' <= c && c <= '9')
+        || c == '_';
+}
+
+char *scan_space_scalar(char *p, char *end) {
+    while (p < end && is_space_char(*p))
+        p++;
+    return p;
+}
+
+char *scan_digit_scalar(char *p, char *end) {
+    while (p < end && is_digit_char(*p))
+        p++;
+    return p;
+}
+
+char *scan_ident_scalar(char *p, char *end) {
+    while (p < end && is_ident_char(*p))
+        p++;
+    return p;
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+// bytes within [lo, hi] (signed compare, so bytes >= 0x80 never match)
+#define RANGE128(c, lo, hi) \
+    _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8((lo) - 1)), \
+                  _mm_cmplt_epi8(c, _mm_set1_epi8((hi) + 1)))
+#define EQ128(c, x) _mm_cmpeq_epi8(c, _mm_set1_epi8(x))
+
+#define SPACE128(c) _mm_or_si128(EQ128(c, ' '), RANGE128(c, '\t', '\r'))
+#define DIGIT128(c) RANGE128(c, '0', '9')
+#define IDENT128(c) \
+    _mm_or_si128(_mm_or_si128(RANGE128(c, 'a', 'z'), RANGE128(c, 'A', 'Z')), \
+                 _mm_or_si128(RANGE128(c, '0', '9'), EQ128(c, '_')))
+
+#define SCAN_SSE2(name, class) \
+    char *name##_sse2(char *p, char *end) { \
+        while (end - p >= 16) { \
+            __m128i c = _mm_loadu_si128((__m128i *)p); \
+            unsigned mask = ~_mm_movemask_epi8(class(c)) & 0xffff; \
+            if (mask) \
+                return p + __builtin_ctz(mask); \
+            p += 16; \
+        } \
+        return name##_scalar(p, end); \
+    }
+
+SCAN_SSE2(scan_space, SPACE128)
+SCAN_SSE2(scan_digit, DIGIT128)
+SCAN_SSE2(scan_ident, IDENT128)
+
+#define RANGE256(c, lo, hi) \
+    _mm256_andnot_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(lo), c), \
+                        _mm256_cmpgt_epi8(_mm256_set1_epi8((hi) + 1), c))
+#define EQ256(c, x) _mm256_cmpeq_epi8(c, _mm256_set1_epi8(x))
+
+#define SPACE256(c) _mm256_or_si256(EQ256(c, ' '), RANGE256(c, '\t', '\r'))
+#define DIGIT256(c) RANGE256(c, '0', '9')
+#define IDENT256(c) \
+    _mm256_or_si256(_mm256_or_si256(RANGE256(c, 'a', 'z'), RANGE256(c, 'A', 'Z')), \
+                    _mm256_or_si256(RANGE256(c, '0', '9'), EQ256(c, '_')))
+
+#define SCAN_AVX2(name, class) \
+    __attribute__((target("avx2"))) \
+    char *name##_avx2(char *p, char *end) { \
+        while (end - p >= 32) { \
+            __m256i c = _mm256_loadu_si256((__m256i *)p); \
+            unsigned mask = ~(unsigned)_mm256_movemask_epi8(class(c)); \
+            if (mask) \
+                return p + __builtin_ctz(mask); \
+            p += 32; \
+        } \
+        return name##_sse2(p, end); \
+    }
+
+SCAN_AVX2(scan_space, SPACE256)
+SCAN_AVX2(scan_digit, DIGIT256)
+SCAN_AVX2(scan_ident, IDENT256)
+#endif
+
+char *(*scan_space)(char *p, char *end) = scan_space_scalar;
+char *(*scan_digit)(char *p, char *end) = scan_digit_scalar;
+char *(*scan_ident)(char *p, char *end) = scan_ident_scalar;
+
+// choose the widest scanners supported by CPU
+void init_scanner(bool simd) {
+    scan_space = scan_space_scalar;
+    scan_digit = scan_digit_scalar;
+    scan_ident = scan_ident_scalar;
+    if (!simd)
+        return;
+
+#ifdef __x86_64__
+    if (__builtin_cpu_supports("avx2")) {
+        scan_space = scan_space_avx2;
+        scan_digit = scan_digit_avx2;
+        scan_ident = scan_ident_avx2;
+        return;
+    }
+    scan_space = scan_space_sse2;
+    scan_digit = scan_digit_sse2;
+    scan_ident = scan_ident_sse2;
+#endif
+}
@@ -0,0 +1,180 @@
+#include "9cc.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define SERVER_MAGIC 0x53433943 // "C9CS"
+
+// header of request, followed by source path and source
+typedef struct Request Request;
+struct Request {
+    unsigned magic; // SERVER_MAGIC
+    int obj; // Object instead of assembly (-c)
+    int path_len; // Length of source path
+    int src_len; // Length of source
+};
+
+// header of reply, followed by output and error messages
+typedef struct Reply Reply;
+struct Reply {
+    int status; // Exit status
+    int out_len; // Length of output
+    int err_len; // Length of messages
+};
+
+bool read_all(int fd, void *p, long len) {
+    for (long off = 0; off < len; ) {
+        long n = read(fd, (char *)p + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+bool write_all(int fd, void *p, long len) {
+    for (long off = 0; off < len; ) {
+        long n = write(fd, (char *)p + off, len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        off += n;
+    }
+    return true;
+}
+
+// compile request of connection and send back reply
+void serve_request(int fd) {
+    Request req;
+    if (!read_all(fd, &req, sizeof(req)) || req.magic != SERVER_MAGIC
+        || req.path_len < 0 || req.src_len < 0)
+        return;
+    char *path = calloc(req.path_len + 1, 1);
+    char *src = calloc(req.src_len + 1, 1);
+    if (!read_all(fd, path, req.path_len) || !read_all(fd, src, req.src_len)) {
+        free(path);
+        free(src);
+        return;
+    }
+
+    // errors are written to reply and unwind to here
+    char *err = NULL;
+    size_t err_len = 0;
+    error_out = open_memstream(&err, &err_len);
+    Buffer *out = calloc(1, sizeof(Buffer));
+    jmp_buf env;
+    int status = 1;
+    if (!setjmp(env)) {
+        error_jmp = &env;
+        opt_obj = req.obj;
+        input_path = path;
+        user_input = src;
+        user_input_end = src + req.src_len;
+        status = compile(out);
+    } else {
+        compile_reset();
+        out->len = 0;
+    }
+    error_jmp = NULL;
+    fclose(error_out);
+    error_out = NULL;
+
+    Reply reply = {status, out->len, err_len};
+    if (write_all(fd, &reply, sizeof(reply)) && write_all(fd, out->data, out->len))
+        write_all(fd, err, err_len);
+
+    if (opt_cache_dir)
+        cache_evict();
+    free(out->data);
+    free(out);
+    free(err);
+    free(path);
+    free(src);
+}
+
+// accept and serve connections until killed
+void *server_worker(void *arg) {
+    int sock = *(int *)arg;
+    for (;;) {
+        int fd = accept(sock, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            error("cannot accept: %s", strerror(errno));
+        }
+        serve_request(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+struct sockaddr_un socket_addr(char *path) {
+    struct sockaddr_un addr = {AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+        error("socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+// listen on Unix socket and serve requests on worker threads
+void serve(char *path) {
+    // clients which hang up must not kill server
+    signal(SIGPIPE, SIG_IGN);
+
+    // socket appears under its name only once it accepts connections
+    char tmp[sizeof(((struct sockaddr_un *)0)->sun_path) + 16];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    struct sockaddr_un addr = socket_addr(tmp);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        error("cannot create socket: %s", strerror(errno));
+    unlink(tmp);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) || listen(sock, SOMAXCONN)
+        || rename(tmp, path))
+        error("cannot listen on %s: %s", path, strerror(errno));
+
+    // main thread takes part as one of workers
+    int nthread = opt_jobs ? opt_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < nthread; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_worker, &sock))
+            error("cannot create thread");
+    }
+    server_worker(&sock);
+}
+
+// send source to server, write its output and return exit status
+int client(char *path) {
+    struct sockaddr_un addr = socket_addr(path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)))
+        error("cannot connect to %s: %s", path, strerror(errno));
+
+    Request req = {SERVER_MAGIC, opt_obj, strlen(input_path), user_input_end - user_input};
+    if (!write_all(sock, &req, sizeof(req)) || !write_all(sock, input_path, req.path_len)
+        || !write_all(sock, user_input, req.src_len))
+        error("cannot send to %s: %s", path, strerror(errno));
+
+    Reply reply;
+    if (!read_all(sock, &reply, sizeof(reply)) || reply.out_len < 0 || reply.err_len < 0)
+        error("no reply from %s", path);
+    Buffer out = {};
+    buf_reserve(&out, reply.out_len);
+    char *err = calloc(reply.err_len + 1, 1);
+    if (!read_all(sock, out.data, reply.out_len) || !read_all(sock, err, reply.err_len))
+        error("no reply from %s", path);
+    out.len = reply.out_len;
+    close(sock);
+
+    fwrite(err, 1, reply.err_len, stderr);
+    if (reply.status == 0)
+        write_output(&out, opt_output);
+    free(out.data);
+    free(err);
+    return reply.status;
+}
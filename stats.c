@@ -0,0 +1,145 @@
+#include "9cc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+// measurement of phase
+typedef struct PhaseStat PhaseStat;
+struct PhaseStat {
+    char *name; // Phase name
+    bool nested; // Runs inside build on worker threads (CPU time only)
+    long wall; // Wall time (ns)
+    long cpu; // CPU time (ns)
+    long alloc; // Bytes allocated from arenas
+    long peak_rss; // Peak resident set size at end (KB)
+    long start_wall; // Clocks at phase_begin
+    long start_cpu;
+    long start_alloc;
+};
+
+PhaseStat phase_stat[] = {
+    [PH_TOKENIZE] = {"tokenize"},
+    [PH_PARSE] = {"parse"},
+    [PH_FOLD] = {"fold"},
+    [PH_INLINE] = {"inline"},
+    [PH_LOOP] = {"loop"},
+    [PH_BUILD] = {"build"},
+    [PH_LOWER] = {"lower", true},
+    [PH_IR_OPT] = {"ir-opt", true},
+    [PH_ISEL] = {"isel", true},
+    [PH_REGALLOC] = {"regalloc", true},
+    [PH_PEEPHOLE] = {"peephole", true},
+    [PH_EMIT] = {"emit", true},
+};
+
+char *node_name[] = {
+    [ND_ADD] = "add", [ND_SUB] = "sub", [ND_MUL] = "mul", [ND_DIV] = "div",
+    [ND_NEG] = "neg", [ND_EQ] = "eq", [ND_NE] = "ne", [ND_LT] = "lt", [ND_LE] = "le",
+    [ND_ASSIGN] = "assign", [ND_ADDR] = "addr", [ND_DEREF] = "deref", [ND_VAR] = "var",
+    [ND_NUM] = "num", [ND_IF] = "if", [ND_WHILE] = "while", [ND_FOR] = "for",
+    [ND_RETURN] = "return", [ND_BLOCK] = "block", [ND_FUNCALL] = "funcall",
+    [ND_INLINE] = "inline",
+};
+
+// counters reported with phases
+_Thread_local int node_count[ND_INLINE + 1];
+_Thread_local int var_count;
+_Thread_local int fn_count;
+long inst_count;
+
+long clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// bytes allocated from arenas so far
+long arena_total() {
+    return lex_arena.bytes + lex_arena.freed + parse_arena.bytes + parse_arena.freed
+        + codegen_arena.bytes + codegen_arena.freed;
+}
+
+void phase_begin(Phase ph) {
+    if (!opt_time_report)
+        return;
+    PhaseStat *st = &phase_stat[ph];
+    st->start_wall = clock_ns(CLOCK_MONOTONIC);
+    st->start_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    st->start_alloc = arena_total();
+}
+
+void phase_end(Phase ph) {
+    if (!opt_time_report)
+        return;
+    PhaseStat *st = &phase_stat[ph];
+    st->wall += clock_ns(CLOCK_MONOTONIC) - st->start_wall;
+    st->cpu += clock_ns(CLOCK_PROCESS_CPUTIME_ID) - st->start_cpu;
+    st->alloc += arena_total() - st->start_alloc;
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    st->peak_rss = ru.ru_maxrss;
+}
+
+// CPU clock of calling thread for phase_lap (0 if not reporting)
+long phase_clock() {
+    return opt_time_report ? clock_ns(CLOCK_THREAD_CPUTIME_ID) : 0;
+}
+
+// charge thread CPU time since start to nested phase and return current clock
+long phase_lap(Phase ph, long start) {
+    if (!opt_time_report)
+        return 0;
+    long now = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    __atomic_fetch_add(&phase_stat[ph].cpu, now - start, __ATOMIC_RELAXED);
+    return now;
+}
+
+void time_report_text() {
+    fprintf(stderr, "%-12s %10s %10s %12s %12s\n",
+            "phase", "wall(ms)", "cpu(ms)", "alloc(KB)", "peak rss(KB)");
+    for (int i = 0; i < sizeof(phase_stat) / sizeof(*phase_stat); i++) {
+        PhaseStat *st = &phase_stat[i];
+        if (st->nested) {
+            fprintf(stderr, "  %-10s %10s %10.3f %12s %12s\n", st->name, "-", st->cpu / 1e6, "-", "-");
+            continue;
+        }
+        fprintf(stderr, "%-12s %10.3f %10.3f %12ld %12ld\n",
+                st->name, st->wall / 1e6, st->cpu / 1e6, st->alloc / 1024, st->peak_rss);
+    }
+
+    fprintf(stderr, "tokens %d, functions %d, variables %d, instructions %ld\n",
+            ntokens, fn_count, var_count, inst_count);
+    fprintf(stderr, "nodes:");
+    for (int i = 0; i <= ND_INLINE; i++)
+        if (node_count[i])
+            fprintf(stderr, " %s %d", node_name[i], node_count[i]);
+    fprintf(stderr, "\n");
+}
+
+void time_report_json() {
+    fprintf(stderr, "{\"phases\": [");
+    for (int i = 0; i < sizeof(phase_stat) / sizeof(*phase_stat); i++) {
+        PhaseStat *st = &phase_stat[i];
+        fprintf(stderr, "%s\n  {\"name\": \"%s\", \"nested\": %s, \"cpu_ms\": %.3f",
+                i ? "," : "", st->name, st->nested ? "true" : "false", st->cpu / 1e6);
+        if (!st->nested)
+            fprintf(stderr, ", \"wall_ms\": %.3f, \"alloc_bytes\": %ld, \"peak_rss_kb\": %ld",
+                    st->wall / 1e6, st->alloc, st->peak_rss);
+        fprintf(stderr, "}");
+    }
+
+    fprintf(stderr, "\n], \"tokens\": %d, \"functions\": %d, \"variables\": %d, \"instructions\": %ld",
+            ntokens, fn_count, var_count, inst_count);
+    fprintf(stderr, ", \"nodes\": {");
+    for (int i = 0; i <= ND_INLINE; i++)
+        fprintf(stderr, "%s\"%s\": %d", i ? ", " : "", node_name[i], node_count[i]);
+    fprintf(stderr, "}}\n");
+}
+
+// print report of -ftime-report to stderr
+void time_report() {
+    if (opt_time_report_json)
+        time_report_json();
+    else
+        time_report_text();
+}
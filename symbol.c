@@ -0,0 +1,114 @@
+#include "9cc.h"
+
+// interned identifiers
+_Thread_local char **intern_names; // Name of each ID
+_Thread_local int *intern_lens; // Length of each name
+_Thread_local int intern_cnt; // Number of IDs
+_Thread_local int *intern_slots; // Open addressing table of ID + 1 (0 if empty)
+_Thread_local int intern_cap; // Number of slots
+
+unsigned hash_string(char *s, int len) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < len; i++)
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h;
+}
+
+// rebuild table with double capacity
+void grow_intern() {
+    int cap = intern_cap ? intern_cap * 2 : 1024;
+    int *slots = calloc(cap, sizeof(int));
+    for (int id = 0; id < intern_cnt; id++) {
+        unsigned i = hash_string(intern_names[id], intern_lens[id]) & (cap - 1);
+        while (slots[i])
+            i = (i + 1) & (cap - 1);
+        slots[i] = id + 1;
+    }
+    free(intern_slots);
+    intern_slots = slots;
+    intern_cap = cap;
+    intern_names = realloc(intern_names, cap * sizeof(char *));
+    intern_lens = realloc(intern_lens, cap * sizeof(int));
+}
+
+// get stable ID of identifier
+int intern(char *s, int len) {
+    if ((intern_cnt + 1) * 2 > intern_cap)
+        grow_intern();
+
+    unsigned i = hash_string(s, len) & (intern_cap - 1);
+    for (; intern_slots[i]; i = (i + 1) & (intern_cap - 1)) {
+        int id = intern_slots[i] - 1;
+        if (intern_lens[id] == len && !memcmp(intern_names[id], s, len))
+            return id;
+    }
+
+    int id = intern_cnt++;
+    intern_names[id] = arena_strndup(&parse_arena, s, len);
+    intern_lens[id] = len;
+    intern_slots[i] = id + 1;
+    return id;
+}
+
+char *intern_name(int id) {
+    return intern_names[id];
+}
+
+// forget all identifiers
+void intern_reset() {
+    free(intern_slots);
+    free(intern_names);
+    free(intern_lens);
+    intern_slots = NULL;
+    intern_names = NULL;
+    intern_lens = NULL;
+    intern_cnt = 0;
+    intern_cap = 0;
+}
+
+Scope *new_scope() {
+    Scope *scope = arena_alloc(&parse_arena, sizeof(Scope));
+    scope->cap = 16;
+    scope->keys = arena_alloc(&parse_arena, scope->cap * sizeof(int));
+    scope->vars = arena_alloc(&parse_arena, scope->cap * sizeof(Var *));
+    return scope;
+}
+
+unsigned scope_slot(Scope *scope, int id) {
+    return (unsigned)id * 2654435761u & (scope->cap - 1);
+}
+
+// find variable by identifier ID
+Var *scope_find(Scope *scope, int id) {
+    for (unsigned i = scope_slot(scope, id); scope->vars[i]; i = (i + 1) & (scope->cap - 1))
+        if (scope->keys[i] == id)
+            return scope->vars[i];
+    return NULL;
+}
+
+void scope_insert(Scope *scope, int id, Var *var) {
+    unsigned i = scope_slot(scope, id);
+    while (scope->vars[i])
+        i = (i + 1) & (scope->cap - 1);
+    scope->keys[i] = id;
+    scope->vars[i] = var;
+    scope->used++;
+}
+
+// add variable to scope
+void scope_add(Scope *scope, int id, Var *var) {
+    if ((scope->used + 1) * 2 > scope->cap) {
+        int cap = scope->cap;
+        int *keys = scope->keys;
+        Var **vars = scope->vars;
+
+        scope->cap *= 2;
+        scope->used = 0;
+        scope->keys = arena_alloc(&parse_arena, scope->cap * sizeof(int));
+        scope->vars = arena_alloc(&parse_arena, scope->cap * sizeof(Var *));
+        for (int i = 0; i < cap; i++)
+            if (vars[i])
+                scope_insert(scope, keys[i], vars[i]);
+    }
+    scope_insert(scope, id, var);
+}
@@ -1,8 +1,9 @@
 #!/bin/bash
 
-# generete tmp_func.o
-gcc -xc -c -o tmp_func.o - <<EOF
+# generete tmp_func.o and tmp_func.so
+cat > tmp_func.in <<EOF
 int foo() { return 12; }
+int aligned() { return ((long)__builtin_frame_address(0) & 15) == 0; }
 int add(int x, int y) { return x + y; }
 int sub(int x, int y) { return x - y; }
 
@@ -10,15 +11,32 @@ int add_6args(int a, int b, int c, int d, int e, int f) {
 	return a + b + c + d + e + f;
 }
 EOF
+gcc -xc -c -o tmp_func.o tmp_func.in
+gcc -xc -shared -fPIC -o tmp_func.so tmp_func.in
 
-# assertion
+# assertion (MODE=asm or MODE=obj links an executable instead of --run)
+# with optional compiler flags
 assert() {
 	expected="$1"
 	input="$2"
-
-	./9cc "$input" > tmp.s
-	gcc -static -o tmp tmp.s tmp_func.o
-	./tmp
+	flags="$3"
+
+	printf '%s' "$input" > tmp.in
+	case "$MODE" in
+	asm)
+		./9cc $flags -o tmp.s tmp.in
+		gcc -static -o tmp tmp.s tmp_func.o
+		./tmp
+		;;
+	obj)
+		./9cc $flags -c -o tmp.o tmp.in
+		gcc -static -o tmp tmp.o tmp_func.o
+		./tmp
+		;;
+	*)
+		./9cc $flags --run --lib ./tmp_func.so tmp.in
+		;;
+	esac
 	actual="$?"
 
 	if [ "$actual" = "$expected" ]; then
@@ -61,6 +79,7 @@ assert 0 'main() {foo=bar=3; return -foo++bar;}'
 
 # return
 assert 2 'main() {1;return 2;3;}'
+assert 7 'main() {returnx=3; iff=4; return returnx+iff;}'
 
 # if-else
 assert 5 'main() {a=5; b=10; if (a>b) return a-b; else return b-a;}'
@@ -100,5 +119,137 @@ assert 5 'main() {x=3; y=&x; *y=5; return x;}'
 assert 7 'main() {x=3; y=5; *(&x+8)=7; return y;}'
 assert 7 'main() {x=3; y=5; *(&y-8)=7; return x;}'
 
+# register pressure
+assert 55 'main() {return 1+(2+(3+(4+(5+(6+(7+(8+(9+10))))))));}'
+assert 20 'main() {a=1; return a+(a+(a+(a+(a+(a+(a+(a+foo())))))));}'
+assert 45 'main() {return 1+(2+(3+(4+(5+(6+(7+add(8, 9)))))));}'
+assert 3 'main() {x=3; y=&x; return *(y+0*(1+(2+(3+(4+(5+(6+(7+8))))))));}'
+
+# constant folding
+assert 13 'main() {return 3*4+1;}'
+assert 5 'main() {x=5; return 0-x+10;}'
+assert 14 'main() {x=7; return x*1+0*x+x/1-0;}'
+assert 3 'main() {x=3; return --x;}'
+assert 3 'main() {if (2>1) return 3; return 4;}'
+assert 0 'main() {i=0; while (0) i=1; for (;0;) i=2; return i;}'
+assert 5 'main() {i=0; while (1) {i=i+1; if (i==5) return i;}}'
+assert 0 'main() {return 0*foo();}'
+
+# compare and branch
+assert 2 'main() {x=5; if (x<3) return 1; if (x<=5) return 2; return 3;}'
+assert 1 'main() {x=5; y=x==5; if (x!=5) return 0; return y;}'
+
+# long runs of whitespace, identifier and digit chars
+assert 6 'main() {an_identifier_longer_than_thirty_two_bytes_x1=1;                                        return an_identifier_longer_than_thirty_two_bytes_x1+00000000000000000000000000000000000005;}'
+assert 3 'main()
+{
+	x=1;
+
+	return x+2;
+}'
+
+# common subexpressions and forwarded loads
+assert 18 'main() {x=3; return x*x+x*x;}'
+assert 16 'main() {x=3; y=5; return *(&x+8)+*(&x+8)+x+x;}'
+assert 7 'main() {x=3; y=x+1; x=4; return x+y-1;}'
+assert 6 'main() {x=2; y=&x; *y=3; return x+x;}'
+assert 4 'main() {x=1; if (x) y=x+1; else y=x+2; return y+x+1;}'
+
+# loop invariants and induction variables
+assert 114 'main() {s=0; n=3; m=4; for (i=0; i<4; i=i+1) s=s+i*8+n*m+i*n; return s;}'
+assert 10 'main() {s=0; j=8; while (j>0) {s=s+j*2/4; j=j-2;} return s-(3+3)/2+3;}'
+assert 6 'main() {x=1; y=2; z=3; s=0; for (i=0; i<3; i=i+1) s=s+*(&x+i*8); return s;}'
+assert 12 'main() {x=1; y=2; s=0; for (i=0; i<3; i=i+1) {s=s+y*3; *(&x+8)=1;} return s+y-1;}'
+assert 20 'main() {s=0; for (i=0; i<3; i=i+1) for (j=0; j<i+1; j=j+1) s=s+i*2+j; return s+foo()-12;}'
+
+# inlining
+assert 10 'main() {return add2(3, 7);} add2(a, b) {return a+b;}'
+assert 9 'max(a, b) {if (a<b) return b; return a;} main() {return max(4, 9)+max(0, -1)+max(0, 0);}'
+assert 21 'twice(x) {return x+x;} quad(x) {return twice(twice(x));} main() {s=0; for (i=0; i<3; i=i+1) s=s+quad(i)-i; return s+12;}'
+assert 55 'fib(n) {if (n<2) return n; return fib(n-1)+fib(n-2);} main() {return fib(10);}'
+assert 6 'odd(n) {if (n==0) return 0; return even(n-1);} even(n) {if (n==0) return 1; return odd(n-1);} main() {return odd(7)+even(4)*5;}'
+assert 7 'sec(a, b) {x=a; y=b; return *(&x+8);} main() {x=3; return sec(1, 7);}'
+
+# calls are made with aligned stack
+assert 3 'g(x) {y=x; return aligned()+x;} main() {return aligned()+g(add(aligned(), 0))*1;}'
+assert 22 'main() {a=1; b=1; c=1; d=1; e=1; f=1; return (a+foo())*((b+foo())*((c+foo())*((d+foo())*((e+foo())*(f+foo()+aligned())))));}'
+
+# constant operands
+assert 42 'main() {x=-29; y=7; return x/4+x/7+x/8*y+(0-x)/10+y*8-y*3-y/2+40;}'
+assert 4 'main() {x=-1000000007; return x/1000+1000000+x/3+333333336+(x*1024)/1024-x+(2<x)+(x<2)*2+x/x;}'
+assert 4 'main() {x=3; y=x+4; return (1<x)+(x<=3)+(4<=y-3)+(7==y)-(x>5);}'
+
+# tail calls run in constant stack
+assert 7 'sum(n, acc) {if (n==0) return acc; return sum(n-1, acc+n);} main() {return sum(10000000, 0)-50000005000000+7;}'
+assert 3 'odd(n) {if (n==0) return 0; return even(n-1);} even(n) {if (n==0) return 1; return odd(n-1);} main() {return odd(10000001)+even(3000000)*2;}'
+assert 9 'f(n, p) {x=n; if (n==0) return *p; return f(n-1, &x);} main() {x=5; return f(3, &x)+8;}'
+
+# variables with disjoint lifetimes share slots
+assert 30 'main() {a=1; b=a+2; c=b*3; d=c-1; e=d+a; f=e*2; return f+foo();}'
+assert 30 'f(n, k) {a=n; s=0; for (i=0; i<n; i=i+1) {t=i*k; s=s+t;} b=s; return a+b;} main() {return f(5, 3)+f(0, 9)-5;}'
+
+# leaf functions keep parameters in registers and need no frame pointer
+assert 183 'f(a, b, c, d, e, g) {x=a/b; y=c/7; z=d/e; if (x>y) return x*100+y*10+z+g; return y*100+x*10+z+g;} main() {return f(99, 9, 50, 30, 4, 6)-1000;}'
+assert 80 'f(n) {a=n;b=n+1;c=n+2;d=n+3;e=n+4;g=n+5;h=n+6;i=n+7;j=n+8;k=n+9;l=n+10;m=n+11;o=n+12;p=n+13;q=n+14;r=n+15;s=n+16;t=n+17;return a*b+c*d+e*g+h*i+j*k+l*m+o*p+q*r+s*t+a+b+c+d+e+g+h+i+j+k+l+m+o+p+q+r+s+t;} main() {return f(1)+f(2);}'
+
+# variables whose address is not taken live in registers
+assert 40 'main() {s=0; for (i=0; i<10; i=i+1) s=s+i*foo(); return s-500;}'
+assert 91 'f(a, b, n) {for (i=0; i<n; i=i+1) {t=a; a=b; b=t+b;} return a;} main() {return f(0, 1, 11)+f(2, 3, 0);}'
+
+# functions taken from cache give same output
+rm -rf tmp.cache
+printf '%s' 'add2(x, y) {return x+y;} main() {return add2(3, 4);}' > tmp.in
+./9cc --cache-dir tmp.cache -o tmp.s tmp.in
+./9cc --cache-dir tmp.cache -o tmp.cached.s tmp.in
+if ! cmp -s tmp.s tmp.cached.s || [ "$(ls tmp.cache | wc -l)" != 2 ]; then
+	printf "cache => \033[1;31mmismatch\033[0m\n"
+	exit 1
+fi
+
+# changed caller still inlines cached callee, and changed callee is not
+# left inlined in cached caller
+printf '%s' 'add2(x, y) {return x+y;} main() {return add2(3, 4)+1;}' > tmp.in
+./9cc -o tmp.s tmp.in
+./9cc --cache-dir tmp.cache -o tmp.cached.s tmp.in
+if ! cmp -s tmp.s tmp.cached.s; then
+	printf "cache => \033[1;31mmismatch\033[0m\n"
+	exit 1
+fi
+assert 8 'add2(x, y) {return x+y;} main() {return add2(3, 4)+1;}' '--cache-dir tmp.cache'
+assert 9 'add2(x, y) {return x+y+1;} main() {return add2(3, 4)+1;}' '--cache-dir tmp.cache'
+rm -rf tmp.cache
+
+# instrumented runs append profile which optimized build reads back
+rm -f tmp.prof
+input='f(x) {if (x<0) return 0-x; return x;} main() {s=0; for (i=0; i<10; i=i+1) s=s+f(i); return s;}'
+assert 45 "$input" -fprofile-generate=tmp.prof
+assert 45 "$input" -fprofile-generate=tmp.prof
+if ! grep -qx 'f 10 0 10' tmp.prof || ! grep -qx 'main 1 10 1' tmp.prof || [ "$(wc -l < tmp.prof)" != 4 ]; then
+	printf "profile => \033[1;31mmismatch\033[0m\n"
+	exit 1
+fi
+assert 45 "$input" -fprofile-use=tmp.prof
+rm -f tmp.prof
+
+# compile server gives same output and survives errors
+rm -f tmp.sock
+./9cc -o tmp.s tmp.in
+./9cc --server tmp.sock -j 2 &
+server=$!
+for i in $(seq 50); do [ -S tmp.sock ] && break; sleep 0.1; done
+message=$(./9cc --client tmp.sock -e 'main() {return x+;}' 2>&1)
+status=$?
+./9cc --client tmp.sock -o tmp.cached.s tmp.in
+# options of server are not overridden by client
+option=$(./9cc --client tmp.sock -fno-fold -o tmp.cached.s tmp.in 2>&1)
+if [ "$status" != 1 ] || [[ "$message" != *"expected a number"* ]] || ! cmp -s tmp.s tmp.cached.s \
+	|| [[ "$option" != *"usage"* ]]; then
+	printf "server => \033[1;31mmismatch\033[0m\n"
+	kill $server
+	exit 1
+fi
+kill $server
+rm -f tmp.sock
+
 # all correct
 printf "\n\033[1;32m=== OK ===\033[0m\n"
\ No newline at end of file
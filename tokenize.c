@@ -1,81 +1,176 @@
 #include "9cc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-Token *current_token;
-char *user_input;
+// state of compilation (requests of server are compiled concurrently)
+_Thread_local Token *tokens;
+_Thread_local int ntokens;
+_Thread_local int tokens_cap;
+_Thread_local int current_token;
+_Thread_local char *user_input;
+_Thread_local char *user_input_end;
+_Thread_local char *input_path;
+
+// where errors are reported (server sends them to client instead of exiting)
+_Thread_local FILE *error_out;
+_Thread_local jmp_buf *error_jmp;
+
+// abandon compilation after error
+void error_exit() {
+    if (error_jmp)
+        longjmp(*error_jmp, 1);
+    exit(1);
+}
 
 // report error
 void error(char *fmt, ...) {
+    FILE *out = error_out ? error_out : stderr;
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n");
+    error_exit();
 }
 
-// report error position
+// report error position with line and column
 void error_at(char *loc, char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
 
-    int pos = loc - user_input;
-    fprintf(stderr, "%s\n", user_input);
-    fprintf(stderr, "%*s", pos, " ");
-    fprintf(stderr, "^ ");
-    vfprintf(stderr, fmt, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    // find line containing loc
+    char *line = loc;
+    while (user_input < line && line[-1] != '\n')
+        line--;
+    char *line_end = loc;
+    while (line_end < user_input_end && *line_end != '\n')
+        line_end++;
+    int line_no = 1;
+    for (char *p = user_input; (p = memchr(p, '\n', line - p)); p++)
+        line_no++;
+
+    int col = loc - line;
+    FILE *out = error_out ? error_out : stderr;
+    fprintf(out, "%s:%d:%d: ", input_path, line_no, col + 1);
+    vfprintf(out, fmt, ap);
+    fprintf(out, "\n%.*s\n", (int)(line_end - line), line);
+    fprintf(out, "%*s^\n", col, "");
+    error_exit();
+}
+
+// read whole file when it cannot be mapped
+char *read_fd(int fd, long *len) {
+    long cap = 4096;
+    char *buf = malloc(cap);
+    *len = 0;
+    for (;;) {
+        if (*len == cap)
+            buf = realloc(buf, cap *= 2);
+        long n = read(fd, buf + *len, cap - *len);
+        if (n < 0)
+            error("cannot read %s: %s", input_path, strerror(errno));
+        if (n == 0)
+            return buf;
+        *len += n;
+    }
+}
+
+// map source file to user_input ("-" reads stdin)
+void read_source(char *path) {
+    input_path = path;
+    int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+    if (fd < 0)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        user_input = "";
+        if (st.st_size > 0)
+            user_input = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (user_input == MAP_FAILED)
+            error("cannot map %s: %s", path, strerror(errno));
+        user_input_end = user_input + st.st_size;
+    } else {
+        long len;
+        user_input = read_fd(fd, &len);
+        user_input_end = user_input + len;
+    }
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
+
+// use string as source
+void set_source(char *str) {
+    input_path = "<command line>";
+    user_input = str;
+    user_input_end = str + strlen(str);
+}
+
+// spelling of punctuators for messages
+char *punct_str[] = {
+    [PN_ADD] = "+", [PN_SUB] = "-", [PN_MUL] = "*", [PN_DIV] = "/",
+    [PN_LPAREN] = "(", [PN_RPAREN] = ")", [PN_LT] = "<", [PN_GT] = ">",
+    [PN_SEMICOLON] = ";", [PN_ASSIGN] = "=", [PN_LBRACE] = "{", [PN_RBRACE] = "}",
+    [PN_COMMA] = ",", [PN_AMP] = "&", [PN_EQ] = "==", [PN_NE] = "!=",
+    [PN_LE] = "<=", [PN_GE] = ">=", [PN_IF] = "if", [PN_ELSE] = "else",
+    [PN_WHILE] = "while", [PN_FOR] = "for", [PN_RETURN] = "return",
+};
+
+// position of token in source
+char *token_loc(Token *token) {
+    return user_input + token->offset;
 }
 
 // read next token
-bool read_next_token(char *op) {
+bool read_next_token(Punct op) {
     // if next token is not expected symbol
-    if (current_token->pattern != TK_RESERVED
-        || strlen(op) != current_token->len
-        || memcmp(current_token->str, op, current_token->len))
+    Token *token = &tokens[current_token];
+    if (token->pattern != TK_RESERVED || token->punct != op)
         return false;
-    current_token = current_token->next;
+    current_token++;
     return true;
 }
 
 // read next identifier
 Token *read_next_ident() {
-    if (current_token->pattern != TK_IDENT)
+    Token *token = &tokens[current_token];
+    if (token->pattern != TK_IDENT)
         return NULL;
-    Token *before_token = current_token;
-    current_token = current_token->next;
-    return before_token;
+    current_token++;
+    return token;
 }
 
 // expect next token
-void expect(char *op) {
+void expect(Punct op) {
     // if next token is not expected symbol
-    if (current_token->pattern != TK_RESERVED
-        || strlen(op) != current_token->len
-        || memcmp(current_token->str, op, current_token->len))
-        error_at(current_token->str, "expected \"%s\"", op);
-    current_token = current_token->next;
+    Token *token = &tokens[current_token];
+    if (token->pattern != TK_RESERVED || token->punct != op)
+        error_at(token_loc(token), "expected \"%s\"", punct_str[op]);
+    current_token++;
 }
 
-// get identifier
-char *get_ident() {
-    if (current_token->pattern != TK_IDENT)
-        error_at(current_token->str, "expected an identifier");
-    char *ident = strndup(current_token->str, current_token->len);
-    current_token = current_token->next;
-    return ident;
+// get interned ID of identifier
+int get_ident() {
+    Token *token = &tokens[current_token];
+    if (token->pattern != TK_IDENT)
+        error_at(token_loc(token), "expected an identifier");
+    current_token++;
+    return token->val;
 }
 
 // get number
 int get_number() {
-    if (current_token->pattern != TK_NUM)
-        error_at(current_token->str, "expected a number");
-    int val = current_token->val;
-    current_token = current_token->next;
-    return val;
+    Token *token = &tokens[current_token];
+    if (token->pattern != TK_NUM)
+        error_at(token_loc(token), "expected a number");
+    current_token++;
+    return token->val;
 }
 
 bool at_eof() {
-    return current_token->pattern == TK_EOF;
+    return tokens[current_token].pattern == TK_EOF;
 }
 
 bool is_alpha(char c) {
@@ -84,106 +179,120 @@ bool is_alpha(char c) {
         || c == '_';
 }
 
-bool is_alnum(char c) {
-    return is_alpha(c) || ('0' <= c && c <= '9');
-}
-
-bool startwith(char *p, char *q) {
-    return memcmp(p, q, strlen(q)) == 0;
+// keyword of identifier of len chars at p (PN_NONE if not keyword)
+Punct keyword(char *p, int len) {
+    switch (len) {
+    case 2:
+        return !memcmp(p, "if", 2) ? PN_IF : PN_NONE;
+    case 3:
+        return !memcmp(p, "for", 3) ? PN_FOR : PN_NONE;
+    case 4:
+        return !memcmp(p, "else", 4) ? PN_ELSE : PN_NONE;
+    case 5:
+        return !memcmp(p, "while", 5) ? PN_WHILE : PN_NONE;
+    case 6:
+        return !memcmp(p, "return", 6) ? PN_RETURN : PN_NONE;
+    }
+    return PN_NONE;
 }
 
-char *startwith_reserved(char *p) {
-    // keyword
-    static char *kw[] = {
-        "if",
-        "else",
-        "while",
-        "for",
-        "return"
-    };
-
-    // decide match keyword
-    for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++) {
-        int len = strlen(kw[i]);
-        if (startwith(p, kw[i]) && !is_alnum(p[len]))
-            return kw[i];
+// punctuator at p and its length
+Punct punctuator(char *p, int *len) {
+    bool eq = p + 1 < user_input_end && p[1] == '=';
+    *len = 1;
+    switch (*p) {
+    case '+': return PN_ADD;
+    case '-': return PN_SUB;
+    case '*': return PN_MUL;
+    case '/': return PN_DIV;
+    case '(': return PN_LPAREN;
+    case ')': return PN_RPAREN;
+    case ';': return PN_SEMICOLON;
+    case '{': return PN_LBRACE;
+    case '}': return PN_RBRACE;
+    case ',': return PN_COMMA;
+    case '&': return PN_AMP;
     }
 
-    // multi-letter punctuator
-    static char *op[] = {
-        "==",
-        "!=",
-        "<=",
-        ">="
-    };
-
-    // decide matchj multi-letter punctuator
-    for (int i = 0; i < sizeof(op) / sizeof(*op); i++) {
-        if (startwith(p, op[i]))
-            return op[i];
+    *len = eq ? 2 : 1;
+    switch (*p) {
+    case '=': return eq ? PN_EQ : PN_ASSIGN;
+    case '<': return eq ? PN_LE : PN_LT;
+    case '>': return eq ? PN_GE : PN_GT;
+    case '!':
+        if (eq)
+            return PN_NE;
     }
-
-    // unmatched
-    return NULL;
+    return PN_NONE;
 }
 
-Token *new_token(TokenPattern pattern, Token *cur, char *str, int len) {
-    Token *token = calloc(1, sizeof(Token));
+// append token to array
+Token *new_token(TokenPattern pattern, char *str, int len) {
+    if (ntokens == tokens_cap) {
+        tokens_cap = tokens_cap ? tokens_cap * 2 : 1024;
+        Token *grown = arena_alloc(&lex_arena, tokens_cap * sizeof(Token));
+        if (ntokens)
+            memcpy(grown, tokens, ntokens * sizeof(Token));
+        tokens = grown;
+    }
+
+    Token *token = &tokens[ntokens++];
     token->pattern = pattern;
-    token->str = str;
+    token->offset = str - user_input;
     token->len = len;
-    cur->next = token;
     return token;
 }
 
-Token *tokenizer() {
+void tokenizer() {
     char *p = user_input;
-    Token head;
-    head.next = NULL;
-    Token *cur = &head;
+    char *end = user_input_end;
+    tokens = NULL;
+    ntokens = 0;
+    tokens_cap = 0;
+    current_token = 0;
 
-    while (*p) {
+    while (p < end) {
         // skip whitespace chars
-        if (isspace(*p)) {
-            p++;
+        if (is_space_char(*p)) {
+            p = scan_space(p + 1, end);
             continue;
         }
 
-        // keyword or multi-letter punctuator
-        char *kw = startwith_reserved(p);
-        if (kw) {
-            int len = strlen(kw);
-            cur = new_token(TK_RESERVED, cur, p, len);
+        // punctuator
+        int len;
+        Punct punct = punctuator(p, &len);
+        if (punct != PN_NONE) {
+            new_token(TK_RESERVED, p, len)->punct = punct;
             p += len;
             continue;
         }
 
-        // single-letter punctuator
-        if (strchr("+-*/()<>;={},&*", *p)) {
-            cur = new_token(TK_RESERVED, cur, p++, 1);
-            continue;
-        }
-
-        // identifier
+        // keyword or identifier
         if (is_alpha(*p)) {
-            char *q = p++;
-            while (is_alnum(*p)) p++;
-            cur = new_token(TK_IDENT, cur, q, p - q);
+            char *q = p;
+            p = scan_ident(p + 1, end);
+            Punct kw = keyword(q, p - q);
+            if (kw != PN_NONE) {
+                new_token(TK_RESERVED, q, p - q)->punct = kw;
+                continue;
+            }
+            new_token(TK_IDENT, q, p - q)->val = intern(q, p - q);
             continue;
         }
 
         // integer literal
-        if (isdigit(*p)) {
-            cur = new_token(TK_NUM, cur, p, 0);
+        if (is_digit_char(*p)) {
             char *q = p;
-            cur->val = strtol(p, &p, 10);
-            cur->len = p - q;
+            p = scan_digit(p + 1, end);
+            long val = 0;
+            for (char *d = q; d < p; d++)
+                val = val * 10 + (*d - '0');
+            new_token(TK_NUM, q, p - q)->val = val;
             continue;
         }
 
         error_at(p, "invalid token");
     }
 
-    new_token(TK_EOF, cur, p, 0);
-    return head.next;
-}
\ No newline at end of file
+    new_token(TK_EOF, p, 0);
+}